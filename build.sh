@@ -2,16 +2,32 @@
 
 set -e
 
-CFLAGS="-Wall -Wno-strict-aliasing -Wno-stringop-truncation -Ofast -g -I$PWD/libavdev/include -I$PWD/libpcap/include"
+CFLAGS="-Wall -Wno-strict-aliasing -Wno-stringop-truncation -O3 -frounding-math -g -I$PWD/libavdev/include -I$PWD/libpcap/include"
 LDFLAGS="-L$PWD/libavdev/lib -lavdev -lgdi32 -lwinmm"
 
 case "$1" in
 --with-libpcap)
-    ${CROSS_COMPILE}gcc --static $CFLAGS utils.c ethphy-libpcap.c  ffvm.c $LDFLAGS -o ffvm
+    ${CROSS_COMPILE}gcc --static $CFLAGS utils.c ethphy-libpcap.c netcsum.c ffvm.c $LDFLAGS -o ffvm
+    ${CROSS_COMPILE}strip --strip-unneeded ffvm.exe
+    ;;
+--with-taplinux)
+    ${CROSS_COMPILE}gcc $CFLAGS utils.c ethphy-taplinux.c netcsum.c ffvm.c -L$PWD/libavdev/lib -lavdev -lpthread -lm -o ffvm
+    ${CROSS_COMPILE}strip --strip-unneeded ffvm
+    ;;
+--with-vswitch)
+    ${CROSS_COMPILE}gcc $CFLAGS utils.c ethphy-vswitch.c netcsum.c ffvm.c -L$PWD/libavdev/lib -lavdev -lpthread -lm -o ffvm
+    ${CROSS_COMPILE}strip --strip-unneeded ffvm
+    ;;
+--with-slirp)
+    ${CROSS_COMPILE}gcc $CFLAGS utils.c ethphy-slirp.c netcsum.c ffvm.c -L$PWD/libavdev/lib -lavdev -lpthread -lm -o ffvm
+    ${CROSS_COMPILE}strip --strip-unneeded ffvm
+    ;;
+--with-pcapfile)
+    ${CROSS_COMPILE}gcc --static $CFLAGS utils.c ethphy-pcapfile.c netcsum.c ffvm.c $LDFLAGS -o ffvm
     ${CROSS_COMPILE}strip --strip-unneeded ffvm.exe
     ;;
 *)
-    ${CROSS_COMPILE}gcc --static $CFLAGS utils.c ethphy-tapwin32.c ffvm.c $LDFLAGS -o ffvm
+    ${CROSS_COMPILE}gcc --static $CFLAGS utils.c ethphy-tapwin32.c netcsum.c ffvm.c $LDFLAGS -o ffvm
     ${CROSS_COMPILE}strip --strip-unneeded ffvm.exe
     ;;
 esac
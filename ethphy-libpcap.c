@@ -27,7 +27,7 @@ typedef struct {
 static void packet_handler(u_char *param, const struct pcap_pkthdr *header, const u_char *pkt_data)
 {
     PHYDEV *phy = (PHYDEV*)param;
-    if (phy->callback) phy->callback(phy->cbctx, (char*)pkt_data, header->len);
+    if (phy->callback) phy->callback(phy->cbctx, (char*)pkt_data, header->len, 0);
 }
 
 static void* ethphy_work_proc(void *arg)
@@ -154,3 +154,12 @@ int ethphy_send(void *ctx, char *buf, int len)
     }
     return 0;
 }
+
+int ethphy_sendv(void *ctx, char *bufs[], int lens[], int num)
+{
+    int i;
+    for (i = 0; i < num; i++) {
+        if (ethphy_send(ctx, bufs[i], lens[i]) != 0) break;
+    }
+    return i;
+}
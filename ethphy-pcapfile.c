@@ -0,0 +1,143 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "ethphy.h"
+#include "utils.h"
+
+// ifname: "capture.pcap[,scale]", frames in the pcap file are replayed into the guest,
+// scale = 1 keeps the original timing, 2 replays twice as fast, 0 replays as fast as the guest takes the frames
+
+#define PCAP_MAGIC_US      0xa1b2c3d4
+#define PCAP_MAGIC_NS      0xa1b23c4d
+#define PCAP_FRAME_MAXSIZE 65536
+
+typedef struct {
+    uint32_t magic;
+    uint16_t version_major;
+    uint16_t version_minor;
+    int32_t  thiszone;
+    uint32_t sigfigs;
+    uint32_t snaplen;
+    uint32_t linktype;
+} PCAP_FILEHDR;
+
+typedef struct {
+    uint32_t ts_sec;
+    uint32_t ts_frac; // us or ns, depends on magic
+    uint32_t caplen;
+    uint32_t len;
+} PCAP_RECHDR;
+
+typedef struct {
+    FILE     *fp;
+    double    scale;
+    int       swap;    // file has different byte order
+    int       nsec;    // timestamps are in ns
+    uint32_t  replayed, discarded;
+
+    #define FLAG_EXIT (1 << 0)
+    uint32_t  flags;
+    pthread_t thread;
+    PFN_ETHPHY_CALLBACK callback;
+    void               *cbctx;
+    uint8_t   buf[PCAP_FRAME_MAXSIZE];
+} PHYDEV;
+
+static uint32_t pcap_swap32(PHYDEV *phy, uint32_t v)
+{
+    return phy->swap ? __builtin_bswap32(v) : v;
+}
+
+static void* ethphy_work_proc(void *arg)
+{
+    PHYDEV     *phy = arg;
+    PCAP_RECHDR rec;
+    uint64_t    ts, ts0 = 0, tick0 = 0, due;
+    int64_t     wait;
+    int         first = 1;
+
+    while (!(phy->flags & FLAG_EXIT) && fread(&rec, sizeof(rec), 1, phy->fp) == 1) {
+        rec.ts_sec  = pcap_swap32(phy, rec.ts_sec );
+        rec.ts_frac = pcap_swap32(phy, rec.ts_frac);
+        rec.caplen  = pcap_swap32(phy, rec.caplen );
+        if (rec.caplen > PCAP_FRAME_MAXSIZE) { printf("phy_pcapfile, bad record length %u !\n", rec.caplen); break; }
+        if (fread(phy->buf, 1, rec.caplen, phy->fp) != rec.caplen) break;
+
+        ts = (uint64_t)rec.ts_sec * 1000000 + (phy->nsec ? rec.ts_frac / 1000 : rec.ts_frac); // in us
+        if (first) { ts0 = ts, tick0 = get_tick_count(), first = 0; }
+        if (phy->scale > 0 && ts > ts0) {
+            due = tick0 + (uint64_t)((ts - ts0) / 1000 / phy->scale);
+            while (!(phy->flags & FLAG_EXIT) && (wait = (int64_t)(due - get_tick_count())) > 0) usleep((wait < 100 ? wait : 100) * 1000);
+        }
+        while (phy->callback && phy->callback(phy->cbctx, (char*)phy->buf, rec.caplen, 1) != 0 && !(phy->flags & FLAG_EXIT)) usleep(100); // the replay waits for the guest
+        phy->replayed++;
+    }
+    printf("phy_pcapfile, replay done, %u frames replayed\n", phy->replayed);
+    return NULL;
+}
+
+void* ethphy_open(char *ifname, PFN_ETHPHY_CALLBACK callback, void *cbctx)
+{
+    PHYDEV      *phy = calloc(1, sizeof(PHYDEV));
+    PCAP_FILEHDR hdr;
+    char         path[256], *p;
+    if (!phy) return NULL;
+
+    snprintf(path, sizeof(path), "%s", ifname ? ifname : "");
+    phy->scale = 1;
+    if ((p = strrchr(path, ','))) { *p = '\0'; phy->scale = atof(p + 1); }
+    phy->callback = callback;
+    phy->cbctx    = cbctx;
+
+    phy->fp = fopen(path, "rb");
+    if (!phy->fp) { printf("phy_open, failed to open pcap file %s !\n", path); goto failed; }
+    if (fread(&hdr, sizeof(hdr), 1, phy->fp) != 1) { printf("phy_open, failed to read pcap file header !\n"); goto failed; }
+    switch (hdr.magic) {
+    case PCAP_MAGIC_US: break;
+    case PCAP_MAGIC_NS: phy->nsec = 1; break;
+    default:
+        if      (__builtin_bswap32(hdr.magic) == PCAP_MAGIC_US) phy->swap = 1;
+        else if (__builtin_bswap32(hdr.magic) == PCAP_MAGIC_NS) phy->swap = phy->nsec = 1;
+        else { printf("phy_open, %s is not a pcap file !\n", path); goto failed; }
+    }
+    if (pcap_swap32(phy, hdr.linktype) != 1) { printf("phy_open, pcap linktype %u is not ethernet !\n", pcap_swap32(phy, hdr.linktype)); goto failed; }
+
+    printf("phy_open, replaying %s, scale %g\n", path, phy->scale);
+    pthread_create(&phy->thread, 0, ethphy_work_proc, phy);
+    return phy;
+
+failed:
+    if (phy->fp) fclose(phy->fp);
+    free(phy);
+    return NULL;
+}
+
+void ethphy_close(void *ctx)
+{
+    PHYDEV *phy = ctx;
+    if (!phy) return;
+    phy->flags |= FLAG_EXIT;
+    pthread_join(phy->thread, NULL);
+    printf("phy_pcapfile, %u frames sent by guest and discarded\n", phy->discarded);
+    fclose(phy->fp);
+    free(phy);
+}
+
+int ethphy_send(void *ctx, char *buf, int len)
+{
+    PHYDEV *phy = ctx;
+    if (!phy) return -1;
+    phy->discarded++; // replay only, nothing to send to
+    return 0;
+}
+
+int ethphy_sendv(void *ctx, char *bufs[], int lens[], int num)
+{
+    PHYDEV *phy = ctx;
+    if (!phy) return -1;
+    phy->discarded += num;
+    return num;
+}
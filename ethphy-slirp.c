@@ -0,0 +1,515 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "ethphy.h"
+#include "netcsum.h"
+#include "utils.h"
+
+// user-mode network stack, no tap device or privilege needed. the guest lives in 10.0.2.0/24 and gets
+// 10.0.2.15 by dhcp, 10.0.2.2 is the gateway, it answers arp and ping, and tcp/udp connections to
+// 10.0.2.2:port are terminated here and relayed to 127.0.0.1:port on the host. frames for the guest are queued
+// and handed to the callback by the work thread with the lock released, never from ethphy_send on the emulation
+// thread, which is the one that drains the receive queue the callback waits on.
+
+#define SLIRP_HOST_IP      0x0A000202
+#define SLIRP_GUEST_IP     0x0A00020F
+#define SLIRP_NETMASK      0xFFFFFF00
+#define SLIRP_FRAME_MAXSIZE 1514
+#define SLIRP_FLOW_MAXNUM  64
+#define SLIRP_TXQ_SIZE     256 // frames queued for the guest, power of 2
+#define SLIRP_UDP_TIMEOUT  60000 // ms
+#define SLIRP_TCP_MSS      1460
+#define SLIRP_TCP_WINDOW   65535
+#define SLIRP_TCP_BUFSIZE  65536
+#define SLIRP_TCP_RTO      300   // ms
+#define SLIRP_TCP_MAXRETX  40    // retransmissions without the guest acking anything new
+#define SLIRP_TCP_TIMEOUT  300000 // ms without a segment from the guest
+
+static const uint8_t s_host_mac[6] = { 0x52, 0x55, 0x0A, 0x00, 0x02, 0x02 };
+
+enum { TCP_CONNECTING, TCP_ESTABLISHED };
+
+#define TCP_FIN 0x01
+#define TCP_SYN 0x02
+#define TCP_RST 0x04
+#define TCP_PSH 0x08
+#define TCP_ACK 0x10
+
+#define seq_lt(a, b)  ((int32_t)((a) - (b)) <  0)
+#define seq_leq(a, b) ((int32_t)((a) - (b)) <= 0)
+
+typedef struct {
+    int      used;
+    int      proto;     // 6 - tcp, 17 - udp
+    int      fd;
+    uint16_t gport;     // guest port
+    uint16_t hport;     // destination port, on 10.0.2.2 for the guest, on 127.0.0.1 for the host
+    uint64_t tick;      // last activity, for tcp the last segment from the guest
+
+    int      state;
+    uint32_t iss;       // our initial sequence number
+    uint32_t rcv_nxt;   // next sequence number expected from guest
+    uint32_t snd_una;   // oldest sequence number not acked by guest
+    uint32_t snd_nxt;   // next sequence number to send
+    uint32_t snd_base;  // sequence number of sndbuf[0]
+    uint32_t snd_wnd;   // guest receive window
+    uint16_t mss;
+    uint8_t  eof;       // host side closed, fin to be sent after sndbuf
+    uint8_t  fin_sent;
+    uint8_t  fin_rcvd;
+    uint64_t rto_tick;
+    uint8_t  retx;      // retransmissions since the guest last acked new data
+    uint8_t *sndbuf;    // data read from host socket, not yet acked by guest
+    int      sndlen;
+} FLOW;
+
+typedef struct {
+    int       evfd;
+    uint8_t   guest_mac[6];
+    uint16_t  ipid;
+    FLOW      flows[SLIRP_FLOW_MAXNUM];
+    pthread_mutex_t lock;
+
+    #define FLAG_EXIT (1 << 0)
+    uint32_t  flags;
+    pthread_t thread;
+    PFN_ETHPHY_CALLBACK callback;
+    void               *cbctx;
+    uint8_t   txbuf[SLIRP_FRAME_MAXSIZE];
+    uint8_t   txq[SLIRP_TXQ_SIZE][SLIRP_FRAME_MAXSIZE];
+    int       txq_len[SLIRP_TXQ_SIZE];
+    uint32_t  txq_head, txq_tail;
+} PHYDEV;
+
+static uint16_t get16(uint8_t *p) { return p[0] << 8 | p[1]; }
+static uint32_t get32(uint8_t *p) { return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3]; }
+static void put16(uint8_t *p, uint16_t v) { p[0] = v >> 8, p[1] = v; }
+static void put32(uint8_t *p, uint32_t v) { p[0] = v >> 24, p[1] = v >> 16, p[2] = v >> 8, p[3] = v; }
+
+// build eth + ipv4 header in phy->txbuf for a packet from 10.0.2.2, returns pointer to l4 header
+static uint8_t* ip_header(PHYDEV *phy, int proto, uint32_t dst, int l4len)
+{
+    uint8_t *eth = phy->txbuf, *ip = eth + 14;
+    memcpy(eth + 0, dst == 0xFFFFFFFF ? (uint8_t*)"\xff\xff\xff\xff\xff\xff" : phy->guest_mac, 6);
+    memcpy(eth + 6, s_host_mac, 6);
+    put16(eth + 12, 0x0800);
+    ip[0] = 0x45, ip[1] = 0;
+    put16(ip + 2, 20 + l4len);
+    put16(ip + 4, phy->ipid++);
+    put16(ip + 6, 0x4000);
+    ip[8] = 64, ip[9] = proto;
+    put32(ip + 12, SLIRP_HOST_IP);
+    put32(ip + 16, dst);
+    return ip + 20;
+}
+
+// queue the frame in phy->txbuf for the work thread, dropped if the queue is full, tcp retransmits it
+static void frame_output(PHYDEV *phy, int len)
+{
+    uint32_t idx = phy->txq_tail & (SLIRP_TXQ_SIZE - 1);
+    uint64_t val = 1;
+    if (phy->txq_tail - phy->txq_head == SLIRP_TXQ_SIZE) return;
+    memcpy(phy->txq[idx], phy->txbuf, len);
+    phy->txq_len[idx] = len;
+    if (phy->txq_tail++ == phy->txq_head) write(phy->evfd, &val, sizeof(val));
+}
+
+// hand the queued frames to the callback, the lock isn't held while it runs. a slot stays untouched until the head
+// moves past it. returns 1 if the guest receive queue is full and frames are left
+static int frame_flush(PHYDEV *phy)
+{
+    uint32_t idx;
+    pthread_mutex_lock(&phy->lock);
+    while (phy->txq_head != phy->txq_tail) {
+        idx = phy->txq_head & (SLIRP_TXQ_SIZE - 1);
+        pthread_mutex_unlock(&phy->lock);
+        if (phy->callback && phy->callback(phy->cbctx, (char*)phy->txq[idx], phy->txq_len[idx], 1) != 0) return 1;
+        pthread_mutex_lock(&phy->lock);
+        phy->txq_head++;
+    }
+    pthread_mutex_unlock(&phy->lock);
+    return 0;
+}
+
+static void ip_output(PHYDEV *phy, int l4len)
+{
+    net_csum_frame(phy->txbuf, 14 + 20 + l4len, 1);
+    frame_output(phy, 14 + 20 + l4len);
+}
+
+static void udp_output(PHYDEV *phy, uint16_t sport, uint32_t dst, uint16_t dport, uint8_t *data, int len)
+{
+    if (len > SLIRP_FRAME_MAXSIZE - 14 - 20 - 8) return;
+    uint8_t *udp = ip_header(phy, 17, dst, 8 + len);
+    put16(udp + 0, sport);
+    put16(udp + 2, dport);
+    put16(udp + 4, 8 + len);
+    put16(udp + 6, 0);
+    memcpy(udp + 8, data, len);
+    ip_output(phy, 8 + len);
+}
+
+static void tcp_output_seg(PHYDEV *phy, FLOW *f, uint32_t seq, int flags, uint8_t *data, int len)
+{
+    int      optlen = (flags & TCP_SYN) ? 4 : 0;
+    uint8_t *tcp    = ip_header(phy, 6, SLIRP_GUEST_IP, 20 + optlen + len);
+    put16(tcp + 0, f->hport);
+    put16(tcp + 2, f->gport);
+    put32(tcp + 4, seq);
+    put32(tcp + 8, (flags & TCP_ACK) ? f->rcv_nxt : 0);
+    tcp[12] = (20 + optlen) / 4 << 4;
+    tcp[13] = flags;
+    put16(tcp + 14, SLIRP_TCP_WINDOW);
+    put16(tcp + 16, 0);
+    put16(tcp + 18, 0);
+    if (optlen) { tcp[20] = 2, tcp[21] = 4; put16(tcp + 22, SLIRP_TCP_MSS); }
+    if (len) memcpy(tcp + 20 + optlen, data, len);
+    ip_output(phy, 20 + optlen + len);
+}
+
+static void tcp_reset(PHYDEV *phy, uint16_t sport, uint16_t dport, uint32_t seq, uint32_t ack, int with_ack)
+{
+    FLOW f = { .hport = sport, .gport = dport, .rcv_nxt = ack };
+    tcp_output_seg(phy, &f, seq, TCP_RST | (with_ack ? TCP_ACK : 0), NULL, 0);
+}
+
+static void flow_free(FLOW *f)
+{
+    if (f->fd >= 0) close(f->fd);
+    free(f->sndbuf);
+    memset(f, 0, sizeof(FLOW));
+    f->fd = -1;
+}
+
+// a tcp flow the guest stopped answering, reset it on both sides so that the slot is free again
+static void tcp_abort(PHYDEV *phy, FLOW *f)
+{
+    struct linger lg = { .l_onoff = 1, .l_linger = 0 };
+    tcp_reset(phy, f->hport, f->gport, f->snd_nxt, f->rcv_nxt, 1);
+    setsockopt(f->fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg)); // the close resets the host side too
+    flow_free(f);
+}
+
+static FLOW* flow_find(PHYDEV *phy, int proto, uint16_t gport, uint16_t hport)
+{
+    for (int i = 0; i < SLIRP_FLOW_MAXNUM; i++) {
+        FLOW *f = &phy->flows[i];
+        if (f->used && f->proto == proto && f->gport == gport && f->hport == hport) return f;
+    }
+    return NULL;
+}
+
+static FLOW* flow_new(PHYDEV *phy, int proto, uint16_t gport, uint16_t hport)
+{
+    struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(hport), .sin_addr.s_addr = htonl(INADDR_LOOPBACK) };
+    uint64_t val = 1;
+    FLOW    *f   = NULL;
+    for (int i = 0; i < SLIRP_FLOW_MAXNUM && !f; i++) if (!phy->flows[i].used) f = &phy->flows[i];
+    if (!f) return NULL;
+    f->fd = socket(AF_INET, (proto == 6 ? SOCK_STREAM : SOCK_DGRAM) | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (f->fd < 0) { flow_free(f); return NULL; }
+    if (connect(f->fd, (struct sockaddr*)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS) { flow_free(f); return NULL; }
+    if (proto == 6 && !(f->sndbuf = malloc(SLIRP_TCP_BUFSIZE))) { flow_free(f); return NULL; }
+    f->used  = 1;
+    f->proto = proto;
+    f->gport = gport;
+    f->hport = hport;
+    f->tick  = get_tick_count();
+    write(phy->evfd, &val, sizeof(val)); // let the work thread poll the new socket
+    return f;
+}
+
+static void tcp_output(PHYDEV *phy, FLOW *f)
+{
+    if (f->state != TCP_ESTABLISHED || seq_lt(f->snd_una, f->iss + 1)) return; // wait for the syn to be acked
+    int off = f->snd_nxt - f->snd_base, n;
+    if (f->fin_sent) return;
+    while (off < f->sndlen && (int)(f->snd_nxt - f->snd_una) < (int)f->snd_wnd) {
+        n = f->sndlen - off;
+        if (n > f->mss) n = f->mss;
+        if (n > (int)(f->snd_wnd - (f->snd_nxt - f->snd_una))) n = f->snd_wnd - (f->snd_nxt - f->snd_una);
+        if (f->snd_una == f->snd_nxt) f->rto_tick = get_tick_count();
+        tcp_output_seg(phy, f, f->snd_nxt, TCP_ACK | TCP_PSH, f->sndbuf + off, n);
+        f->snd_nxt += n, off += n;
+    }
+    if (f->eof && off == f->sndlen) {
+        if (f->snd_una == f->snd_nxt) f->rto_tick = get_tick_count();
+        tcp_output_seg(phy, f, f->snd_nxt, TCP_ACK | TCP_FIN, NULL, 0);
+        f->snd_nxt++, f->fin_sent = 1;
+    }
+}
+
+static void tcp_input(PHYDEV *phy, uint8_t *tcp, int len)
+{
+    uint16_t sport = get16(tcp + 0), dport = get16(tcp + 2);
+    uint32_t seq   = get32(tcp + 4), ack   = get32(tcp + 8);
+    int      hlen  = (tcp[12] >> 4) * 4, flags = tcp[13], dlen = len - hlen, n;
+    FLOW    *f     = flow_find(phy, 6, sport, dport);
+    if (hlen < 20 || dlen < 0) return;
+
+    if (flags & TCP_RST) { if (f) flow_free(f); return; }
+    if (!f) {
+        if ((flags & (TCP_SYN | TCP_ACK)) != TCP_SYN) { tcp_reset(phy, dport, sport, ack, seq + dlen + !!(flags & TCP_FIN), !(flags & TCP_ACK)); return; }
+        if (!(f = flow_new(phy, 6, sport, dport))) { tcp_reset(phy, dport, sport, 0, seq + 1, 1); return; }
+        f->state   = TCP_CONNECTING;
+        f->iss     = (uint32_t)get_tick_count() * 64000;
+        f->snd_una = f->snd_nxt = f->iss;
+        f->snd_base= f->iss + 1;
+        f->rcv_nxt = seq + 1;
+        f->snd_wnd = get16(tcp + 14);
+        f->mss     = 536;
+        for (uint8_t *opt = tcp + 20, *end = tcp + hlen; opt < end && *opt != 0; opt += opt[0] == 1 ? 1 : opt[1]) {
+            if (opt[0] == 1) continue;
+            if (opt + 2 > end || opt[1] < 2 || opt + opt[1] > end) break; // truncated option
+            if (opt[0] == 2 && opt[1] == 4) f->mss = get16(opt + 2);
+        }
+        if (f->mss > SLIRP_TCP_MSS) f->mss = SLIRP_TCP_MSS;
+        return; // syn-ack is sent once the host connection is established
+    }
+    f->tick = get_tick_count();
+    if (flags & TCP_SYN) { // retransmitted syn
+        if (f->state == TCP_ESTABLISHED && f->snd_una == f->iss) tcp_output_seg(phy, f, f->iss, TCP_SYN | TCP_ACK, NULL, 0);
+        return;
+    }
+    if (f->state != TCP_ESTABLISHED) return;
+
+    if ((flags & TCP_ACK) && seq_lt(f->snd_una, ack) && seq_leq(ack, f->snd_nxt)) {
+        f->snd_una = ack;
+        n = ack - f->snd_base;
+        if (n > f->sndlen) n = f->sndlen; // fin acked
+        if (n > 0) {
+            memmove(f->sndbuf, f->sndbuf + n, f->sndlen - n);
+            f->sndlen -= n, f->snd_base += n;
+        }
+        f->rto_tick = get_tick_count();
+        f->retx     = 0;
+    }
+    if (flags & TCP_ACK) f->snd_wnd = get16(tcp + 14);
+
+    if (dlen > 0 || (flags & TCP_FIN)) {
+        if (seq == f->rcv_nxt && !f->fin_rcvd) {
+            n = dlen ? send(f->fd, tcp + hlen, dlen, MSG_NOSIGNAL) : 0;
+            if (n > 0) f->rcv_nxt += n; // what the host socket didn't take is left for the guest to retransmit
+            if (n == dlen && (flags & TCP_FIN)) { f->rcv_nxt++, f->fin_rcvd = 1; shutdown(f->fd, SHUT_WR); }
+        }
+        tcp_output_seg(phy, f, f->snd_nxt, TCP_ACK, NULL, 0);
+    }
+    tcp_output(phy, f);
+    if (f->fin_rcvd && f->fin_sent && f->snd_una == f->snd_nxt) flow_free(f);
+}
+
+static void udp_input(PHYDEV *phy, uint8_t *ip, uint8_t *udp, int len)
+{
+    uint16_t sport = get16(udp + 0), dport = get16(udp + 2);
+    int      ulen  = get16(udp + 4);
+    if (ulen < 8 || ulen > len) return;
+    if (dport == 67) { // dhcp server
+        uint8_t *bootp = udp + 8, *end = udp + ulen, *opt, reply[300] = {};
+        int      type  = 0;
+        if (ulen - 8 < 240 || bootp[0] != 1 || get32(bootp + 236) != 0x63825363) return;
+        for (opt = bootp + 240; opt < end && opt[0] != 255; opt += opt[0] ? 2 + opt[1] : 1) {
+            if (opt[0] && (opt + 2 > end || opt + 2 + opt[1] > end)) break; // truncated option
+            if (opt[0] == 53 && opt[1] >= 1) type = opt[2];
+        }
+        if (type != 1 && type != 3) return; // discover & request
+        reply[0] = 2, reply[1] = 1, reply[2] = 6;
+        memcpy(reply + 4 , bootp + 4 , 4);  // xid
+        memcpy(reply + 10, bootp + 10, 2);  // flags
+        put32 (reply + 16, SLIRP_GUEST_IP); // yiaddr
+        put32 (reply + 20, SLIRP_HOST_IP ); // siaddr
+        memcpy(reply + 28, bootp + 28, 16); // chaddr
+        put32 (reply + 236, 0x63825363);
+        opt = reply + 240;
+        *opt++ = 53, *opt++ = 1, *opt++ = type == 1 ? 2 : 5; // offer or ack
+        *opt++ = 54, *opt++ = 4; put32(opt, SLIRP_HOST_IP); opt += 4;
+        *opt++ = 51, *opt++ = 4; put32(opt, 86400        ); opt += 4;
+        *opt++ = 1 , *opt++ = 4; put32(opt, SLIRP_NETMASK); opt += 4;
+        *opt++ = 3 , *opt++ = 4; put32(opt, SLIRP_HOST_IP); opt += 4;
+        *opt++ = 255;
+        udp_output(phy, 67, 0xFFFFFFFF, 68, reply, opt - reply);
+        return;
+    }
+    if (get32(ip + 16) != SLIRP_HOST_IP) return;
+    FLOW *f = flow_find(phy, 17, sport, dport);
+    if (!f && !(f = flow_new(phy, 17, sport, dport))) return;
+    f->tick = get_tick_count();
+    send(f->fd, udp + 8, ulen - 8, MSG_NOSIGNAL);
+}
+
+static void ip_input(PHYDEV *phy, uint8_t *ip, int len)
+{
+    int iphl, totlen;
+    if (len < 20 || (ip[0] >> 4) != 4) return;
+    iphl = (ip[0] & 0xF) * 4, totlen = get16(ip + 2);
+    if (totlen > len || totlen < iphl || (get16(ip + 6) & 0x3FFF)) return; // fragments not supported
+    uint8_t *l4 = ip + iphl;
+    int    l4len = totlen - iphl;
+    switch (ip[9]) {
+    case 1: // icmp echo to the gateway
+        if (get32(ip + 16) == SLIRP_HOST_IP && l4len >= 8 && l4[0] == 8 && l4len <= SLIRP_FRAME_MAXSIZE - 34) {
+            uint8_t *icmp = ip_header(phy, 1, get32(ip + 12), l4len);
+            memcpy(icmp, l4, l4len);
+            icmp[0] = 0;
+            ip_output(phy, l4len);
+        }
+        break;
+    case 6 : if (get32(ip + 16) == SLIRP_HOST_IP && l4len >= 20) tcp_input(phy, l4, l4len); break;
+    case 17: if (l4len >= 8) udp_input(phy, ip, l4, l4len); break;
+    }
+}
+
+static void arp_input(PHYDEV *phy, uint8_t *arp, int len)
+{
+    if (len < 28 || get16(arp + 6) != 1) return; // request
+    uint32_t tip = get32(arp + 24);
+    if ((tip & SLIRP_NETMASK) != (SLIRP_HOST_IP & SLIRP_NETMASK) || tip == SLIRP_GUEST_IP) return;
+    uint8_t *eth = phy->txbuf, *rep = eth + 14;
+    memcpy(eth + 0, arp + 8, 6);
+    memcpy(eth + 6, s_host_mac, 6);
+    put16(eth + 12, 0x0806);
+    memcpy(rep, arp, 6);
+    put16 (rep + 6 , 2);
+    memcpy(rep + 8 , s_host_mac, 6);
+    put32 (rep + 14, tip);
+    memcpy(rep + 18, arp + 8, 10); // sender hw & ip become target
+    memset(eth + 42, 0, 18);
+    frame_output(phy, 60);
+}
+
+static void* ethphy_work_proc(void *arg)
+{
+    PHYDEV       *phy = arg;
+    struct pollfd pfds[SLIRP_FLOW_MAXNUM + 1];
+    FLOW         *pflows[SLIRP_FLOW_MAXNUM + 1];
+    uint8_t       buf[SLIRP_FRAME_MAXSIZE];
+    uint64_t      val, now;
+    int           n, i, full, room;
+
+    while (!(phy->flags & FLAG_EXIT)) {
+        full = frame_flush(phy);
+        pthread_mutex_lock(&phy->lock);
+        room = phy->txq_tail - phy->txq_head < SLIRP_TXQ_SIZE / 2; // stop reading the host sockets while the guest lags
+        pfds[0] = (struct pollfd){ .fd = phy->evfd, .events = POLLIN };
+        for (n = 1, i = 0; i < SLIRP_FLOW_MAXNUM; i++) {
+            FLOW *f = &phy->flows[i];
+            if (!f->used) continue;
+            pfds[n].fd     = f->fd;
+            pfds[n].events = f->proto == 17 ? (room ? POLLIN : 0) : f->state == TCP_CONNECTING ? POLLOUT : (room && !f->eof && f->sndlen < SLIRP_TCP_BUFSIZE ? POLLIN : 0);
+            pflows[n++]    = f;
+        }
+        pthread_mutex_unlock(&phy->lock);
+
+        poll(pfds, n, full ? 1 : 50); // retry the frames the guest had no room for soon
+        if (pfds[0].revents & POLLIN) read(phy->evfd, &val, sizeof(val));
+
+        pthread_mutex_lock(&phy->lock);
+        now = get_tick_count();
+        for (i = 1; i < n; i++) {
+            FLOW *f = pflows[i];
+            if (!f->used || f->fd != pfds[i].fd) continue; // freed meanwhile
+            if (f->proto == 17) {
+                if (pfds[i].revents & POLLIN) {
+                    int len = recv(f->fd, buf, sizeof(buf), 0);
+                    if (len >= 0) { udp_output(phy, f->hport, SLIRP_GUEST_IP, f->gport, buf, len); f->tick = now; }
+                }
+                if (now - f->tick > SLIRP_UDP_TIMEOUT) flow_free(f);
+                continue;
+            }
+            if (now - f->tick > SLIRP_TCP_TIMEOUT) { tcp_abort(phy, f); continue; } // the guest is gone or never closes
+            if (f->state == TCP_CONNECTING) {
+                if (!pfds[i].revents) continue;
+                int err = 0; socklen_t errlen = sizeof(err);
+                getsockopt(f->fd, SOL_SOCKET, SO_ERROR, &err, &errlen);
+                if (err) { tcp_reset(phy, f->hport, f->gport, 0, f->rcv_nxt, 1); flow_free(f); continue; }
+                f->state = TCP_ESTABLISHED;
+                f->snd_nxt = f->iss + 1;
+                f->rto_tick = now;
+                tcp_output_seg(phy, f, f->iss, TCP_SYN | TCP_ACK, NULL, 0);
+                continue;
+            }
+            if (pfds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+                int len = recv(f->fd, f->sndbuf + f->sndlen, SLIRP_TCP_BUFSIZE - f->sndlen, 0);
+                if (len > 0) f->sndlen += len;
+                else if (len == 0 || (errno != EAGAIN && errno != EINTR)) f->eof = 1;
+                tcp_output(phy, f);
+            }
+            if (f->snd_una != f->snd_nxt && now - f->rto_tick > SLIRP_TCP_RTO) { // go back n
+                if (++f->retx > SLIRP_TCP_MAXRETX) { tcp_abort(phy, f); continue; }
+                f->rto_tick = now;
+                if (f->snd_una == f->iss) { tcp_output_seg(phy, f, f->iss, TCP_SYN | TCP_ACK, NULL, 0); continue; }
+                f->snd_nxt  = f->snd_una;
+                f->fin_sent = 0;
+                tcp_output(phy, f);
+            }
+            if (f->fin_rcvd && f->fin_sent && f->snd_una == f->snd_nxt) flow_free(f);
+        }
+        pthread_mutex_unlock(&phy->lock);
+    }
+    return NULL;
+}
+
+void* ethphy_open(char *ifname, PFN_ETHPHY_CALLBACK callback, void *cbctx)
+{
+    PHYDEV *phy = calloc(1, sizeof(PHYDEV));
+    if (!phy) return NULL;
+
+    phy->callback = callback;
+    phy->cbctx    = cbctx;
+    for (int i = 0; i < SLIRP_FLOW_MAXNUM; i++) phy->flows[i].fd = -1;
+    pthread_mutex_init(&phy->lock, NULL);
+    phy->evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (phy->evfd < 0) { printf("phy_open, failed to create eventfd !\n"); pthread_mutex_destroy(&phy->lock); free(phy); return NULL; }
+
+    printf("phy_open, user-mode network, guest 10.0.2.15, gateway 10.0.2.2 -> host 127.0.0.1\n");
+    pthread_create(&phy->thread, 0, ethphy_work_proc, phy);
+    return phy;
+}
+
+void ethphy_close(void *ctx)
+{
+    PHYDEV  *phy = ctx;
+    uint64_t val = 1;
+    if (!phy) return;
+    phy->flags |= FLAG_EXIT;
+    write(phy->evfd, &val, sizeof(val));
+    pthread_join(phy->thread, NULL);
+    for (int i = 0; i < SLIRP_FLOW_MAXNUM; i++) if (phy->flows[i].used) flow_free(&phy->flows[i]);
+    close(phy->evfd);
+    pthread_mutex_destroy(&phy->lock);
+    free(phy);
+}
+
+int ethphy_send(void *ctx, char *buf, int len)
+{
+    PHYDEV  *phy   = ctx;
+    uint8_t *frame = (uint8_t*)buf;
+    if (!phy) return -1;
+    if (len < 14) return 0;
+    pthread_mutex_lock(&phy->lock);
+    if (!(frame[6] & 1)) memcpy(phy->guest_mac, frame + 6, 6);
+    switch (get16(frame + 12)) {
+    case 0x0806: arp_input(phy, frame + 14, len - 14); break;
+    case 0x0800: ip_input (phy, frame + 14, len - 14); break;
+    }
+    pthread_mutex_unlock(&phy->lock);
+    return 0;
+}
+
+int ethphy_sendv(void *ctx, char *bufs[], int lens[], int num)
+{
+    int i;
+    for (i = 0; i < num; i++) {
+        if (ethphy_send(ctx, bufs[i], lens[i]) != 0) break;
+    }
+    return i;
+}
@@ -0,0 +1,134 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <net/if.h>
+#include <linux/if_tun.h>
+#include "ethphy.h"
+
+#define TAP_FRAME_MAXSIZE  1600
+#define TAP_BATCH_MAXNUM   32
+
+typedef struct {
+    int       fd;   // /dev/net/tun fd, in tap mode
+    int       epfd; // epoll fd
+    int       evfd; // eventfd used to wake up the work thread on close
+
+    #define FLAG_EXIT (1 << 0)
+    uint32_t  flags;
+    pthread_t thread;
+    PFN_ETHPHY_CALLBACK callback;
+    void               *cbctx;
+
+    uint8_t   rxbuf[TAP_BATCH_MAXNUM][TAP_FRAME_MAXSIZE];
+    int       rxlen[TAP_BATCH_MAXNUM];
+} PHYDEV;
+
+static void* ethphy_work_proc(void *arg)
+{
+    PHYDEV *phy = arg;
+    struct epoll_event events[2];
+    int    n, i, j;
+
+    while (!(phy->flags & FLAG_EXIT)) {
+        n = epoll_wait(phy->epfd, events, 2, -1);
+        if (n < 0 && errno != EINTR) break;
+        for (i = 0; i < n; i++) {
+            if (events[i].data.fd != phy->fd) continue; // eventfd, exit flag is checked by loop
+            do { // drain the tap queue, up to TAP_BATCH_MAXNUM frames per wakeup
+                for (j = 0; j < TAP_BATCH_MAXNUM; j++) {
+                    phy->rxlen[j] = read(phy->fd, phy->rxbuf[j], TAP_FRAME_MAXSIZE);
+                    if (phy->rxlen[j] <= 0) break;
+                }
+                if (phy->callback) {
+                    for (int k = 0; k < j; k++) phy->callback(phy->cbctx, (char*)phy->rxbuf[k], phy->rxlen[k], 0);
+                }
+            } while (j == TAP_BATCH_MAXNUM && !(phy->flags & FLAG_EXIT));
+        }
+    }
+    return NULL;
+}
+
+void* ethphy_open(char *ifname, PFN_ETHPHY_CALLBACK callback, void *cbctx)
+{
+    PHYDEV *phy = calloc(1, sizeof(PHYDEV));
+    if (!phy) return NULL;
+
+    phy->fd = phy->epfd = phy->evfd = -1;
+    phy->callback = callback;
+    phy->cbctx    = cbctx;
+
+    phy->fd = open("/dev/net/tun", O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (phy->fd < 0) { printf("phy_open, failed to open /dev/net/tun !\n"); goto failed; }
+
+    struct ifreq ifr = {};
+    ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+    if (ifname) strncpy(ifr.ifr_name, ifname, IFNAMSIZ - 1);
+    if (ioctl(phy->fd, TUNSETIFF, &ifr) < 0) { printf("phy_open, failed to attach tap device %s !\n", ifr.ifr_name); goto failed; }
+
+    phy->epfd = epoll_create1(EPOLL_CLOEXEC);
+    phy->evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (phy->epfd < 0 || phy->evfd < 0) { printf("phy_open, failed to create epoll/eventfd !\n"); goto failed; }
+
+    struct epoll_event ev = { .events = EPOLLIN };
+    ev.data.fd = phy->fd;
+    if (epoll_ctl(phy->epfd, EPOLL_CTL_ADD, phy->fd  , &ev) < 0) { printf("phy_open, failed to add tap fd to epoll !\n"); goto failed; }
+    ev.data.fd = phy->evfd;
+    if (epoll_ctl(phy->epfd, EPOLL_CTL_ADD, phy->evfd, &ev) < 0) { printf("phy_open, failed to add eventfd to epoll !\n"); goto failed; }
+
+    printf("phy_open, attached to %s\n", ifr.ifr_name);
+    pthread_create(&phy->thread, 0, ethphy_work_proc, phy);
+    return phy;
+
+failed:
+    if (phy->evfd >= 0) close(phy->evfd);
+    if (phy->epfd >= 0) close(phy->epfd);
+    if (phy->fd   >= 0) close(phy->fd  );
+    free(phy);
+    return NULL;
+}
+
+void ethphy_close(void *ctx)
+{
+    PHYDEV  *phy = ctx;
+    uint64_t val = 1;
+    if (!phy) return;
+    phy->flags |= FLAG_EXIT;
+    write(phy->evfd, &val, sizeof(val));
+    pthread_join(phy->thread, NULL);
+    close(phy->evfd);
+    close(phy->epfd);
+    close(phy->fd  );
+    free(phy);
+}
+
+int ethphy_send(void *ctx, char *buf, int len)
+{
+    PHYDEV *phy = ctx;
+    if (!phy) return -1;
+    while (write(phy->fd, buf, len) < 0) {
+        if (errno == EAGAIN) { // tap tx queue full, wait a while for it
+            struct pollfd pfd = { .fd = phy->fd, .events = POLLOUT };
+            if (poll(&pfd, 1, 10) > 0) continue;
+        } else if (errno == EINTR) continue;
+        return -1;
+    }
+    return 0;
+}
+
+int ethphy_sendv(void *ctx, char *bufs[], int lens[], int num)
+{
+    int i;
+    for (i = 0; i < num; i++) {
+        if (ethphy_send(ctx, bufs[i], lens[i]) != 0) break;
+    }
+    return i;
+}
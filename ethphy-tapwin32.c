@@ -260,7 +260,7 @@ static void* ethphy_work_proc(void *arg)
                 break;
             }
         }
-        if (readn > 0 && phy->callback) phy->callback(phy->cbctx, (char*)buf, readn);
+        if (readn > 0 && phy->callback) phy->callback(phy->cbctx, (char*)buf, readn, 0);
     }
     return NULL;
 }
@@ -330,3 +330,12 @@ int ethphy_send(void *ctx, char *buf, int len)
     }
     return 0;
 }
+
+int ethphy_sendv(void *ctx, char *bufs[], int lens[], int num)
+{
+    int i;
+    for (i = 0; i < num; i++) {
+        if (ethphy_send(ctx, bufs[i], lens[i]) != 0) break;
+    }
+    return i;
+}
@@ -0,0 +1,302 @@
+#define _GNU_SOURCE
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <poll.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <sys/un.h>
+#include "ethphy.h"
+#include "utils.h"
+
+// ifname: directory of the switch, e.g. "/tmp/ffvm-vswitch". every port binds a unix datagram socket
+// named port-<pid>-<n> in that directory, ports of the same process exchange frames by calling each
+// other's callback directly, with a reference on the port and no lock held. each port learns source macs of the frames it receives, known unicast
+// frames go to a single port, others are flooded to all ports.
+
+#define VSW_FRAME_MAXSIZE 2048
+#define VSW_BATCH_MAXNUM  32
+#define VSW_MACTAB_SIZE   256 // must be power of 2
+#define VSW_PEER_MAXNUM   64
+#define VSW_LOCAL_MAXNUM  64 // ports of this process a frame goes to
+#define VSW_MAC_AGING     (300 * 1000) // ms
+#define VSW_PEER_RESCAN   1000         // ms
+
+typedef struct tagPHYDEV PHYDEV;
+
+typedef struct {
+    uint8_t  mac[6];
+    uint8_t  valid;
+    PHYDEV  *local; // learned from a port of this process
+    struct sockaddr_un addr;
+    uint64_t tick;
+} MACENTRY;
+
+struct tagPHYDEV {
+    int       fd;
+    int       evfd;
+    char      dir[64];
+    struct sockaddr_un addr;
+    struct sockaddr_un peers[VSW_PEER_MAXNUM];
+    int       peernum;
+    uint64_t  peertick;
+    MACENTRY  mactab[VSW_MACTAB_SIZE];
+    pthread_mutex_t lock;
+    PHYDEV   *next;
+    int       refs; // deliveries to this port in progress, under s_ports_lock
+
+    #define FLAG_EXIT (1 << 0)
+    uint32_t  flags;
+    pthread_t thread;
+    PFN_ETHPHY_CALLBACK callback;
+    void               *cbctx;
+
+    uint8_t            rxbuf [VSW_BATCH_MAXNUM][VSW_FRAME_MAXSIZE];
+    struct sockaddr_un rxaddr[VSW_BATCH_MAXNUM];
+    struct iovec       rxiov [VSW_BATCH_MAXNUM];
+    struct mmsghdr     rxmsg [VSW_BATCH_MAXNUM];
+};
+
+static pthread_mutex_t s_ports_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  s_ports_cond = PTHREAD_COND_INITIALIZER;
+static PHYDEV         *s_ports      = NULL;
+static int             s_port_cnt   = 0;
+
+// the ports of this process a frame from phy goes to, only that one or all the others for a flood, each with a
+// reference taken so that they can be called without s_ports_lock
+static int ports_get(PHYDEV *phy, PHYDEV *only, PHYDEV **ports)
+{
+    int n = 0;
+    pthread_mutex_lock(&s_ports_lock);
+    for (PHYDEV *p = s_ports; p && n < VSW_LOCAL_MAXNUM; p = p->next) {
+        if (only ? p == only : p != phy) p->refs++, ports[n++] = p;
+    }
+    pthread_mutex_unlock(&s_ports_lock);
+    return n;
+}
+
+static void ports_put(PHYDEV **ports, int n)
+{
+    pthread_mutex_lock(&s_ports_lock);
+    while (n-- > 0) if (--ports[n]->refs == 0) pthread_cond_broadcast(&s_ports_cond);
+    pthread_mutex_unlock(&s_ports_lock);
+}
+
+static MACENTRY* mactab_entry(PHYDEV *phy, uint8_t *mac)
+{
+    uint32_t hash = (mac[2] << 24 | mac[3] << 16 | mac[4] << 8 | mac[5]) * 2654435761u;
+    return &phy->mactab[hash >> 24 & (VSW_MACTAB_SIZE - 1)];
+}
+
+static void mactab_learn(PHYDEV *phy, uint8_t *mac, PHYDEV *local, struct sockaddr_un *addr)
+{
+    if (mac[0] & 1) return; // multicast source, invalid
+    pthread_mutex_lock(&phy->lock);
+    MACENTRY *e = mactab_entry(phy, mac);
+    memcpy(e->mac, mac, 6);
+    e->local = local;
+    if (addr) e->addr = *addr;
+    e->tick  = get_tick_count();
+    e->valid = 1;
+    pthread_mutex_unlock(&phy->lock);
+}
+
+static int mactab_lookup(PHYDEV *phy, uint8_t *mac, PHYDEV **local, struct sockaddr_un *addr)
+{
+    int found = 0;
+    if (mac[0] & 1) return 0; // broadcast & multicast are flooded
+    pthread_mutex_lock(&phy->lock);
+    MACENTRY *e = mactab_entry(phy, mac);
+    if (e->valid && memcmp(e->mac, mac, 6) == 0) {
+        if (get_tick_count() - e->tick < VSW_MAC_AGING) { *local = e->local, *addr = e->addr, found = 1; }
+        else e->valid = 0;
+    }
+    pthread_mutex_unlock(&phy->lock);
+    return found;
+}
+
+static void peers_rescan(PHYDEV *phy)
+{
+    struct dirent *ent;
+    DIR           *dir;
+    if (get_tick_count() - phy->peertick < VSW_PEER_RESCAN) return;
+    phy->peertick = get_tick_count();
+    phy->peernum  = 0;
+    if (!(dir = opendir(phy->dir))) return;
+    while ((ent = readdir(dir)) && phy->peernum < VSW_PEER_MAXNUM) {
+        if (strncmp(ent->d_name, "port-", 5) != 0) continue;
+        struct sockaddr_un *peer = &phy->peers[phy->peernum];
+        peer->sun_family = AF_UNIX;
+        snprintf(peer->sun_path, sizeof(peer->sun_path), "%.63s/%.40s", phy->dir, ent->d_name);
+        if (strcmp(peer->sun_path, phy->addr.sun_path) == 0) continue;
+        pthread_mutex_lock(&s_ports_lock); // ports of this process are served without socket
+        PHYDEV *p; for (p = s_ports; p && strcmp(p->addr.sun_path, peer->sun_path); p = p->next);
+        pthread_mutex_unlock(&s_ports_lock);
+        if (!p) phy->peernum++;
+    }
+    closedir(dir);
+}
+
+static void deliver_local(PHYDEV *phy, PHYDEV *dst, char *buf, int len)
+{
+    mactab_learn(dst, (uint8_t*)buf + 6, phy, NULL);
+    if (dst->callback) dst->callback(dst->cbctx, buf, len, 0);
+}
+
+static void* ethphy_work_proc(void *arg)
+{
+    PHYDEV *phy = arg;
+    struct pollfd pfds[2] = { { .fd = phy->fd, .events = POLLIN }, { .fd = phy->evfd, .events = POLLIN } };
+    int    n, i;
+
+    for (i = 0; i < VSW_BATCH_MAXNUM; i++) {
+        phy->rxiov[i].iov_base = phy->rxbuf[i];
+        phy->rxiov[i].iov_len  = VSW_FRAME_MAXSIZE;
+        phy->rxmsg[i].msg_hdr.msg_iov  = &phy->rxiov[i];
+        phy->rxmsg[i].msg_hdr.msg_iovlen = 1;
+        phy->rxmsg[i].msg_hdr.msg_name = &phy->rxaddr[i];
+    }
+    while (!(phy->flags & FLAG_EXIT)) {
+        if (poll(pfds, 2, -1) <= 0 || !(pfds[0].revents & POLLIN)) continue;
+        for (i = 0; i < VSW_BATCH_MAXNUM; i++) phy->rxmsg[i].msg_hdr.msg_namelen = sizeof(struct sockaddr_un);
+        n = recvmmsg(phy->fd, phy->rxmsg, VSW_BATCH_MAXNUM, MSG_DONTWAIT, NULL);
+        for (i = 0; i < n; i++) {
+            if (phy->rxmsg[i].msg_len < 14) continue;
+            mactab_learn(phy, phy->rxbuf[i] + 6, NULL, &phy->rxaddr[i]);
+            if (phy->callback) phy->callback(phy->cbctx, (char*)phy->rxbuf[i], phy->rxmsg[i].msg_len, 0);
+        }
+    }
+    return NULL;
+}
+
+void* ethphy_open(char *ifname, PFN_ETHPHY_CALLBACK callback, void *cbctx)
+{
+    PHYDEV *phy = calloc(1, sizeof(PHYDEV));
+    if (!phy) return NULL;
+
+    phy->fd = phy->evfd = -1;
+    phy->callback = callback;
+    phy->cbctx    = cbctx;
+    pthread_mutex_init(&phy->lock, NULL);
+    snprintf(phy->dir, sizeof(phy->dir), "%s", ifname && ifname[0] ? ifname : "/tmp/ffvm-vswitch");
+    mkdir(phy->dir, 0777);
+
+    phy->fd   = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    phy->evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (phy->fd < 0 || phy->evfd < 0) { printf("phy_open, failed to create socket/eventfd !\n"); goto failed; }
+
+    int bufsize = 1024 * 1024;
+    setsockopt(phy->fd, SOL_SOCKET, SO_RCVBUF, &bufsize, sizeof(bufsize));
+    setsockopt(phy->fd, SOL_SOCKET, SO_SNDBUF, &bufsize, sizeof(bufsize));
+
+    pthread_mutex_lock(&s_ports_lock);
+    phy->addr.sun_family = AF_UNIX;
+    snprintf(phy->addr.sun_path, sizeof(phy->addr.sun_path), "%s/port-%d-%d", phy->dir, (int)getpid(), s_port_cnt++);
+    unlink(phy->addr.sun_path);
+    if (bind(phy->fd, (struct sockaddr*)&phy->addr, sizeof(phy->addr)) < 0) {
+        pthread_mutex_unlock(&s_ports_lock);
+        printf("phy_open, failed to bind %s !\n", phy->addr.sun_path);
+        goto failed;
+    }
+    phy->next = s_ports; s_ports = phy;
+    pthread_mutex_unlock(&s_ports_lock);
+
+    printf("phy_open, vswitch port %s\n", phy->addr.sun_path);
+    pthread_create(&phy->thread, 0, ethphy_work_proc, phy);
+    return phy;
+
+failed:
+    if (phy->evfd >= 0) close(phy->evfd);
+    if (phy->fd   >= 0) close(phy->fd  );
+    pthread_mutex_destroy(&phy->lock);
+    free(phy);
+    return NULL;
+}
+
+void ethphy_close(void *ctx)
+{
+    PHYDEV  *phy = ctx, **pp;
+    uint64_t val = 1;
+    if (!phy) return;
+    pthread_mutex_lock(&s_ports_lock);
+    for (pp = &s_ports; *pp && *pp != phy; pp = &(*pp)->next);
+    if (*pp) *pp = phy->next;
+    for (PHYDEV *p = s_ports; p; p = p->next) { // forget the macs learned from this port
+        pthread_mutex_lock(&p->lock);
+        for (int i = 0; i < VSW_MACTAB_SIZE; i++) if (p->mactab[i].local == phy) p->mactab[i].valid = 0;
+        pthread_mutex_unlock(&p->lock);
+    }
+    while (phy->refs) pthread_cond_wait(&s_ports_cond, &s_ports_lock); // no new ones once it's off the list
+    pthread_mutex_unlock(&s_ports_lock);
+    phy->flags |= FLAG_EXIT;
+    write(phy->evfd, &val, sizeof(val));
+    pthread_join(phy->thread, NULL);
+    close(phy->evfd);
+    close(phy->fd  );
+    unlink(phy->addr.sun_path);
+    pthread_mutex_destroy(&phy->lock);
+    free(phy);
+}
+
+static void sendmmsg_all(PHYDEV *phy, struct mmsghdr *msgs, int n)
+{
+    int off = 0, ret;
+    while (off < n) {
+        ret = sendmmsg(phy->fd, msgs + off, n - off, MSG_DONTWAIT);
+        if (ret > 0) { off += ret; continue; }
+        if (errno == ECONNREFUSED) { // port of an exited instance, remove it
+            unlink(((struct sockaddr_un*)msgs[off].msg_hdr.msg_name)->sun_path);
+            phy->peertick = 0;
+        }
+        off++; // skip the failed frame (stale port or peer queue full)
+    }
+}
+
+int ethphy_sendv(void *ctx, char *bufs[], int lens[], int num)
+{
+    PHYDEV            *phy = ctx, *local, *ports[VSW_LOCAL_MAXNUM];
+    struct sockaddr_un dsts[VSW_BATCH_MAXNUM];
+    struct mmsghdr     msgs[VSW_BATCH_MAXNUM];
+    struct iovec       iovs[VSW_BATCH_MAXNUM];
+    int                n = 0, m, i, j;
+    if (!phy) return -1;
+
+    peers_rescan(phy);
+    for (i = 0; i < num; i++) {
+        if (lens[i] < 14) continue;
+        if (mactab_lookup(phy, (uint8_t*)bufs[i], &local, &dsts[n])) { // known unicast
+            if (local) {
+                m = ports_get(phy, local, ports);
+                for (j = 0; j < m; j++) deliver_local(phy, ports[j], bufs[i], lens[i]);
+                ports_put(ports, m);
+                continue;
+            }
+            iovs[n] = (struct iovec){ bufs[i], lens[i] };
+            msgs[n].msg_hdr = (struct msghdr){ .msg_name = &dsts[n], .msg_namelen = sizeof(dsts[n]), .msg_iov = &iovs[n], .msg_iovlen = 1 };
+            if (++n == VSW_BATCH_MAXNUM) { sendmmsg_all(phy, msgs, n); n = 0; }
+            continue;
+        }
+        m = ports_get(phy, NULL, ports); // broadcast, multicast or unknown unicast, flood to all ports
+        for (j = 0; j < m; j++) deliver_local(phy, ports[j], bufs[i], lens[i]);
+        ports_put(ports, m);
+        for (j = 0; j < phy->peernum; j++) {
+            iovs[n] = (struct iovec){ bufs[i], lens[i] };
+            msgs[n].msg_hdr = (struct msghdr){ .msg_name = &phy->peers[j], .msg_namelen = sizeof(phy->peers[j]), .msg_iov = &iovs[n], .msg_iovlen = 1 };
+            if (++n == VSW_BATCH_MAXNUM) { sendmmsg_all(phy, msgs, n); n = 0; }
+        }
+    }
+    if (n) sendmmsg_all(phy, msgs, n);
+    return num;
+}
+
+int ethphy_send(void *ctx, char *buf, int len)
+{
+    return ethphy_sendv(ctx, &buf, &len, 1) == 1 ? 0 : -1;
+}
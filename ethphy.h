@@ -1,10 +1,13 @@
 #ifndef __ETHPHY_H__
 #define __ETHPHY_H__
 
-typedef void (*PFN_ETHPHY_CALLBACK)(void *cbctx, char *buf, int len);
+// returns 0 once the frame is queued or dropped. with retry the backend keeps a frame that finds the receive queue full
+// and offers it again, the callback returns -1 for it instead of dropping it
+typedef int (*PFN_ETHPHY_CALLBACK)(void *cbctx, char *buf, int len, int retry);
 
 void* ethphy_open (char *ifname, PFN_ETHPHY_CALLBACK callback, void *cbctx);
 void  ethphy_close(void *ctx);
 int   ethphy_send (void *ctx, char *buf, int len);
+int   ethphy_sendv(void *ctx, char *bufs[], int lens[], int num); // send num frames, return the number of frames sent
 
 #endif
@@ -3,19 +3,38 @@
 #include <stdio.h>
 #include <string.h>
 #include <time.h>
+#include <math.h>
+#include <fenv.h>
+#include <setjmp.h>
+#include <sched.h>
 #include <unistd.h>
 #include <pthread.h>
+#include <sys/time.h>
 #include <libavdev/adev.h>
 #include <libavdev/vdev.h>
 #include <libavdev/idev.h>
 #include "ethphy.h"
+#include "netcsum.h"
 #include "utils.h"
 
 #define FFVM_ADEV_MAX_BUFNUM      5
 
 #define RISCV_CPU_FREQ_MAX       (100*1000*1000)
 #define RISCV_FRAMERATE           100
+#define RISCV_VLEN                256
+#define RISCV_VLENB              (RISCV_VLEN / 8)
+#define FFVM_FAST_SLICE_US        1000 // host time of a fast forward slice while devices are live, 10x when idle
+#define FFVM_FAST_SLICE_MIN      (100*1000)
 #define RISCV_DISK_SECTSIZE       512
+#define FFVM_MAX_HARTS            8
+#define FFVM_MEM_SIZE_MIN        (1    * 1024 * 1024)
+#define FFVM_MEM_SIZE_DEF        (64   * 1024 * 1024)
+#define FFVM_MEM_SIZE_MAX        (1024 * 1024 * 1024)
+#define RISCV_RESERVED_NONE       0xFFFFFFFF
+#define RISCV_RESERVED_SLOTS      256 // must be power of 2
+#define RISCV_PMP_ENTRIES         16
+#define RISCV_TLB_SIZE            256 // per access type and mode, must be power of 2
+#define RISCV_TLB_NONE            0xFFFFFFFF
 
 #define REG_FFVM_STDIO            0xFF000000
 #define REG_FFVM_STDERR           0xFF000004
@@ -56,6 +75,9 @@
 #define REG_FFVM_MTIMECMPL        0xFF000408
 #define REG_FFVM_MTIMECMPH        0xFF00040C
 #define REG_FFVM_REALTIME         0xFF000410
+#define REG_FFVM_MTIME_FREQ       0xFF000414
+#define FFVM_MTIME_FREQ_MIN       1000
+#define FFVM_MTIME_FREQ_MAX       1000000
 
 #define REG_FFVM_DISK_SECTOR_NUM  0xFF000500
 #define REG_FFVM_DISK_SECTOR_SIZE 0xFF000504
@@ -81,17 +103,145 @@
 #define REG_FFVM_ETHPHY_IN_HEAD   0xFF00070C
 #define REG_FFVM_ETHPHY_IN_TAIL   0xFF000710
 #define REG_FFVM_ETHPHY_IN_SIZE   0xFF000714
+#define REG_FFVM_ETHPHY_MODE      0xFF000718
+#define REG_FFVM_ETHPHY_TXD_ADDR  0xFF00071C
+#define REG_FFVM_ETHPHY_TXD_NUM   0xFF000720
+#define REG_FFVM_ETHPHY_TXD_HEAD  0xFF000724
+#define REG_FFVM_ETHPHY_TXD_TAIL  0xFF000728
+#define REG_FFVM_ETHPHY_RXD_ADDR  0xFF00072C
+#define REG_FFVM_ETHPHY_RXD_NUM   0xFF000730
+#define REG_FFVM_ETHPHY_RXD_HEAD  0xFF000734
+#define REG_FFVM_ETHPHY_RXD_TAIL  0xFF000738
+#define REG_FFVM_ETHPHY_COAL_NUM  0xFF00073C
+#define REG_FFVM_ETHPHY_COAL_TIME 0xFF000740
+#define REG_FFVM_ETHPHY_RX_DROPS  0xFF000744
+#define REG_FFVM_ETHPHY_RX_OVRUN  0xFF000748
+#define REG_FFVM_ETHPHY_OFFLOAD   0xFF00074C
+#define REG_FFVM_ETHPHY_TSO_MSS   0xFF000750
+
+#define REG_FFVM_CLINT_MSIP       0xFF010000 // + 4 * hartid
+#define REG_FFVM_CLINT_MTIMECMP   0xFF014000 // + 8 * hartid
+#define REG_FFVM_CLINT_MTIME      0xFF01BFF8
+#define REG_FFVM_CLINT_END        0xFF020000
+#define REG_FFVM_PLIC_PRIORITY    0xFF400000 // + 4 * source
+#define REG_FFVM_PLIC_PENDING     0xFF401000
+#define REG_FFVM_PLIC_ENABLE      0xFF402000 // + 0x80 * context
+#define REG_FFVM_PLIC_THRESHOLD   0xFF600000 // + 0x1000 * context
+#define REG_FFVM_PLIC_CLAIM       0xFF600004 // + 0x1000 * context
+#define REG_FFVM_PLIC_END         0xFF800000
+#define FFVM_PLIC_SOURCES         32 // source n is irq_flags bit n - 1, there is no source 0
+#define FFVM_PLIC_CONTEXTS       (2 * FFVM_MAX_HARTS) // m-mode and s-mode of each hart
+#define FFVM_PLIC_PRIO_MAX        7
+
+#define FFVM_SBI_FDT_SIZE         0x4000 // the device tree goes at the top of the ram
+#define FFVM_SBI_SPEC_VERSION    (2 << 24)
+#define FFVM_SBI_IMPL_ID          0xFF
+#define FFVM_SBI_EXT_BASE         0x10
+#define FFVM_SBI_EXT_TIME         0x54494D45
+#define FFVM_SBI_EXT_IPI          0x00735049
+#define FFVM_SBI_EXT_RFNC         0x52464E43
+#define FFVM_SBI_EXT_HSM          0x0048534D
+#define FFVM_SBI_EXT_SRST         0x53525354
+#define FFVM_SBI_EXT_DBCN         0x4442434E
+#define FFVM_SBI_ERR_NOT_SUPPORTED    -2
+#define FFVM_SBI_ERR_INVALID_PARAM    -3
+#define FFVM_SBI_ERR_ALREADY_AVAILABLE -6
+#define FFVM_HSM_STARTED          0
+#define FFVM_HSM_STOPPED          1
+#define FFVM_HSM_START_PENDING    2
+
+#define FFVM_ETHPHY_MODE_RING     0
+#define FFVM_ETHPHY_MODE_DESC     1
+#define FFVM_ETHPHY_DESC_DONE    (1 << 0)
+#define FFVM_ETHPHY_DESC_CSUM    (1 << 1) // tx: insert checksums, rx: checksums verified ok
+#define FFVM_ETHPHY_DESC_TSO     (1 << 2) // tx: tcp segmentation, rx: bad checksum
+#define FFVM_ETHPHY_OFFLOAD_TXCSUM (1 << 0)
+#define FFVM_ETHPHY_OFFLOAD_RXCSUM (1 << 1)
+#define FFVM_ETHPHY_OFFLOAD_TSO    (1 << 2)
+#define FFVM_ETHPHY_TSO_MAXMSS    1500
+#define FFVM_ETHPHY_TXD_BATCH     32
+#define FFVM_ETHPHY_RXQ_SIZE      256 // must be power of 2
+#define FFVM_ETHPHY_FRAME_MAX     2048
+
+typedef struct {
+    uint32_t addr;  // frame buffer address
+    uint16_t size;  // tx: frame size, rx: buffer size when posted, frame size when done
+    uint16_t flags; // bit0 - done, bit1 - tx: csum, rx: csum ok, bit2 - tx: tso, rx: csum bad
+} ETHDESC;
+
+typedef struct {
+    uint32_t addr;
+    uint32_t size;
+    char    *name;
+} SYMBOL;
+
+typedef struct {
+    uint32_t  vpn;    // virtual page number, RISCV_TLB_NONE if the entry is empty
+    uintptr_t addend; // host address of the page less its virtual address, an access adds its address to it
+} TLBENTRY;
 
 typedef struct {
+    uint32_t seq; // slot sequence number of the bounded mpsc queue
+    uint32_t len;
+    uint8_t  data[FFVM_ETHPHY_FRAME_MAX];
+} ETHFRAME;
+
+typedef struct RISCV {
     uint32_t pc;
     uint32_t x[32];
     uint64_t f[32];
+    uint32_t fround;      // rounding mode the host fpu is currently set to, see riscv_fp_round
+    uint8_t  v[32][RISCV_VLENB]; // vector registers, a register group is contiguous
     uint32_t csr[0x1000];
-    uint32_t mreserved;
-    #define MAX_MEM_SIZE (64 * 1024 * 1024)
-    uint8_t  mem[MAX_MEM_SIZE];
+    uint32_t mreserved;   // lr.w reservation address, RISCV_RESERVED_NONE if there is none
+    uint32_t mreserved_val; // the value lr.w loaded, sc.w stores only if memory still holds it
+    uint32_t irq_pending; // an interrupt may have become takeable, checked at the end of each block
+    uint32_t mip_soft;    // the mip bits software sets, the others follow their sources, see riscv_mip
+    uint32_t mtip;        // the mip bit the mtimecmp deadline raises, stip when the built-in sbi has m-mode
+    uint32_t msip;        // clint software interrupt
+    uint64_t mcycle;      // instructions executed plus the ones wfi stood for
+    uint64_t cycle_end;   // riscv_run_slice runs until mcycle reaches it
+    uint64_t cycle_idle;  // cycles wfi stood for, minstret is mcycle minus these
+    uint64_t cycle_off;   // guest writes to mcycle/minstret are kept as offsets
+    uint64_t instret_off;
+    #define riscv_slice_break(riscv) ((riscv)->cycle_end = (riscv)->mcycle + 1) // timer setup or cpu_freq changed, replan
+    uint32_t host_rate;   // measured instructions per second the host manages
+    uint32_t wfi;         // wfi executed, riscv_run_slice puts the hart to sleep
+    uint32_t wfi_kick;    // device event while sleeping in wfi
+    pthread_mutex_t wfi_lock;
+    pthread_cond_t  wfi_cond;
+    uint8_t *mem;         // shared by all the harts, anonymous mapping, pages are only backed once touched
+    uint32_t mem_mask;    // ram size - 1, the size is a power of 2, ram repeats over the address space below mmio
+
+    struct RISCV *mach;   // hart 0, it owns the devices, the secondary harts only have their own timer
+    struct RISCV *harts[FFVM_MAX_HARTS];
+    uint32_t nharts;
+    pthread_t thread;     // host thread of a secondary hart
+    pthread_mutex_t mmio_lock;
+    uint32_t *reserved;   // hart 0's reserved_tab, kept per hart so the store path needs no extra load
+    uint32_t reserved_tab[RISCV_RESERVED_SLOTS]; // words reserved by lr.w on any hart, direct mapped
+    uint32_t priv;        // privilege mode, 0 - user, 1 - supervisor, 3 - machine
+    TLBENTRY *tlb[3];     // per access type, load store fetch, the tlb of the mode it's done in, see riscv_tlb_select
+    TLBENTRY tlb_tab[4][3][RISCV_TLB_SIZE]; // the modes, user, supervisor, supervisor with mstatus:sum and machine
+    uint32_t tlb_super;   // a superpage is cached, see riscv_tlb_flush
+    uint32_t tlb_shoot;   // another hart asked for a flush of the translating tlbs, see ffvm_sbi_rfence
+    uint32_t hsm;         // sbi hart state, a stopped hart sleeps in riscv_wfi until it's started
+    uint32_t hsm_addr;    // where a pending start goes and its a1
+    uint32_t hsm_opaque;
+    uint32_t pmp_num;     // entries up to the last one that is on
+    jmp_buf  trap_jmp;    // an access fault abandons the instruction, see riscv_run_block
+    SYMBOL  *sym_tab;     // function and object symbols of an elf rom sorted by address, see riscv_symbol
+    uint32_t sym_num;
+    char    *sym_str;
 
-    uint64_t ffvm_start_tick;
+    uint64_t ffvm_start_tick; // us
+    uint32_t ffvm_start_time; // host time(NULL) at start
+    uint32_t vtime;           // virtual time, mtime follows mcycle at cpu_freq instead of the host clock
+    uint64_t vtime_us;        // virtual time at vtime_cycle, rebased when cpu_freq changes
+    uint64_t vtime_cycle;
+    uint64_t vtime_aout;      // virtual time audio out has been consumed up to
+    uint32_t fast;            // fast forward, no throttling, slices sized to the host rate
+    uint32_t sbi;             // built-in sbi, the harts boot in s-mode and their ecalls are served by ffvm
     uint32_t ffvm_realtime_diff;
     void    *adev, *vdev;
     IDEV    *idev;
@@ -126,6 +276,10 @@ typedef struct {
     uint32_t irq_aout_thres;
     uint32_t irq_ain_thres;
     uint32_t irq_ethp_thres;
+    uint32_t plic_prio  [FFVM_PLIC_SOURCES ];
+    uint32_t plic_enable[FFVM_PLIC_CONTEXTS];
+    uint32_t plic_thres [FFVM_PLIC_CONTEXTS];
+    uint32_t plic_claimed; // sources claimed and not completed yet, they're not pending meanwhile
 
     uint32_t ethphy_out_addr;
     uint32_t ethphy_out_size;
@@ -133,10 +287,37 @@ typedef struct {
     uint32_t ethphy_in_head;
     uint32_t ethphy_in_tail;
     uint32_t ethphy_in_size;
+    uint32_t ethphy_mode;
+    uint32_t ethphy_txd_addr;
+    uint32_t ethphy_txd_num;
+    uint32_t ethphy_txd_head;
+    uint32_t ethphy_txd_tail;
+    uint32_t ethphy_rxd_addr;
+    uint32_t ethphy_rxd_num;
+    uint32_t ethphy_rxd_head;
+    uint32_t ethphy_rxd_tail;
+    uint32_t ethphy_coal_num;
+    uint32_t ethphy_coal_time;
+    uint32_t ethphy_rx_drops;
+    uint32_t ethphy_rx_overruns;
+    uint32_t ethphy_rx_stalled; // the guest ring was full on the last drain, an overrun is counted once per stall
+    uint32_t ethphy_offload;
+    uint32_t ethphy_tso_mss;
+    uint32_t ethphy_coal_pend;
+    uint64_t ethphy_coal_tick;
     void    *ethphy_dev;
+    ETHFRAME ethphy_rxq[FFVM_ETHPHY_RXQ_SIZE];
+    uint32_t ethphy_rxq_enq;
+    uint32_t ethphy_rxq_deq;
+    FILE    *ethphy_pcap;
+    char    *ethphy_txb_bufs[FFVM_ETHPHY_TXD_BATCH];
+    int      ethphy_txb_lens[FFVM_ETHPHY_TXD_BATCH];
+    int      ethphy_txb_num;
+    uint8_t  ethphy_txseg[FFVM_ETHPHY_TXD_BATCH][FFVM_ETHPHY_FRAME_MAX];
 
     uint64_t mtimecur;
     uint64_t mtimecmp;
+    uint32_t mtime_freq; // mtime ticks per second
 
     FILE    *disk_fp;
 } RISCV;
@@ -179,6 +360,19 @@ static uint64_t get_file_size(FILE *fp)
     return size;
 }
 
+// the host address of len bytes of guest ram at addr for a device to access, NULL if they run past the end of the ram
+static uint8_t* ffvm_mem_buf(RISCV *riscv, uint32_t addr, uint64_t len)
+{
+    uint32_t off = addr & riscv->mem_mask;
+    return off + len <= riscv->mem_mask + 1ull ? riscv->mem + off : NULL;
+}
+
+// the ring buffer of a device in guest ram, NULL if it doesn't fit in the ram or the guest set head or tail past its end
+static uint8_t* ffvm_ring_buf(RISCV *riscv, uint32_t addr, uint32_t size, uint32_t head, uint32_t tail)
+{
+    return head < size && tail < size ? ffvm_mem_buf(riscv, addr, size) : NULL;
+}
+
 static void disp_init(RISCV *riscv, int wh)
 {
     if (riscv->disp_wh != wh) {
@@ -204,11 +398,13 @@ static void disp_refresh(RISCV *riscv, uint32_t counter)
         ry = (riscv->disp_refresh_xy >>16) & 0xFFFF;
         rw = (riscv->disp_refresh_wh >> 0) & 0xFFFF;
         rh = (riscv->disp_refresh_wh >>16) & 0xFFFF;
-        BMP *bmp = vdev_lock(riscv->vdev);
+        uint64_t len = rw && rh ? (uint64_t)(ry + rh - 1) * dw + rx + rw : 0; // in pixels, up to the last one of the rect
+        uint8_t *mem = len ? ffvm_mem_buf(riscv, riscv->disp_addr, len * sizeof(uint32_t)) : NULL;
+        BMP     *bmp = mem ? vdev_lock(riscv->vdev) : NULL;
         if (bmp) {
-            uint32_t *src = (uint32_t*)(riscv->mem + riscv->disp_addr % MAX_MEM_SIZE) + ry * dw + rx;
+            uint32_t *src = (uint32_t*)mem + ry * dw + rx;
             uint32_t *dst = (uint32_t*)bmp->pdata + ry * dw + rx;
-            for (i = 0; i < rh; i++) {
+            for (i = 0; i < rh && len <= (uint64_t)bmp->width * bmp->height; i++) { // the rect has to fit in the bitmap too
                 memcpy(dst, src, rw * sizeof(uint32_t));
                 src += dw, dst += dw;
             }
@@ -229,21 +425,98 @@ static void disp_bitblt(RISCV *riscv)
     int       dw  = (riscv->disp_wh        >> 0 ) & 0xFFFF;
     int       sw  = (riscv->disp_bitblt_wh >> 0 ) & 0xFFFF;
     int       sh  = (riscv->disp_bitblt_wh >> 16) & 0xFFFF;
-    uint32_t *src = (uint32_t*)(riscv->mem + riscv->disp_bitblt_addr % MAX_MEM_SIZE);
-    uint32_t *dst = (uint32_t*)(riscv->mem + riscv->disp_addr % MAX_MEM_SIZE) + dy * dw + dx;
+    uint32_t *src = (uint32_t*)ffvm_mem_buf(riscv, riscv->disp_bitblt_addr, (uint64_t)sw * sh * sizeof(uint32_t));
+    uint32_t *dst = (uint32_t*)ffvm_mem_buf(riscv, riscv->disp_addr, (sw && sh ? (uint64_t)(dy + sh - 1) * dw + dx + sw : 0) * sizeof(uint32_t));
+    if (!src || !dst) return;
+    dst += dy * dw + dx;
     for (int i = 0; i < sh; i++) {
         memcpy(dst, src, sw * sizeof(uint32_t));
         dst += dw, src += sw;
     }
 }
 
+// with more than one hart the devices are shared, mmio and the frame work of hart 0 go under the machine lock
+#define ffvm_lock(riscv)   do { if ((riscv)->mach->nharts > 1) pthread_mutex_lock  (&(riscv)->mach->mmio_lock); } while (0)
+#define ffvm_unlock(riscv) do { if ((riscv)->mach->nharts > 1) pthread_mutex_unlock(&(riscv)->mach->mmio_lock); } while (0)
+
+// may be called from device threads
+static void ffvm_wfi_kick(RISCV *riscv)
+{
+    pthread_mutex_lock(&riscv->wfi_lock);
+    riscv->wfi_kick = 1;
+    pthread_cond_signal(&riscv->wfi_cond);
+    pthread_mutex_unlock(&riscv->wfi_lock);
+}
+
+// an interrupt source of the hart changed, it looks at mip again at the end of its block and leaves wfi
+static void ffvm_irq_notify(RISCV *riscv)
+{
+    __atomic_store_n(&riscv->irq_pending, 1, __ATOMIC_RELEASE);
+    ffvm_wfi_kick(riscv);
+}
+
+// the plic may route a device interrupt to any of the harts
+static void ffvm_irq_raise(RISCV *riscv, uint32_t flag)
+{
+    __atomic_fetch_or(&riscv->irq_flags, flag, __ATOMIC_RELAXED);
+    for (uint32_t i = 0; i < riscv->nharts; i++) ffvm_irq_notify(riscv->harts[i]);
+}
+
+// the source a claim by plic context ctx gets, the highest priority one of the pending and enabled sources above
+// the context threshold, the lowest numbered on a tie, 0 if there's none. a device stays pending while its
+// irq_flags bit is set, except between the claim and the completion
+static uint32_t ffvm_plic_best(RISCV *mach, uint32_t ctx)
+{
+    uint32_t pend = (__atomic_load_n(&mach->irq_flags, __ATOMIC_RELAXED) << 1) & mach->plic_enable[ctx] & ~mach->plic_claimed;
+    uint32_t prio = mach->plic_thres[ctx], best = 0, i;
+    for (i = 1; i < FFVM_PLIC_SOURCES && pend >> i; i++) { // pend >> 32 is undefined
+        if (((pend >> i) & 1) && mach->plic_prio[i] > prio) prio = mach->plic_prio[i], best = i;
+    }
+    return best;
+}
+
+static uint32_t ffvm_plic_read(RISCV *mach, uint32_t addr)
+{
+    uint32_t ctx, id;
+    if (addr < REG_FFVM_PLIC_PENDING) return (addr - REG_FFVM_PLIC_PRIORITY) / 4 < FFVM_PLIC_SOURCES ? mach->plic_prio[(addr - REG_FFVM_PLIC_PRIORITY) / 4] : 0;
+    if (addr == REG_FFVM_PLIC_PENDING) return (mach->irq_flags << 1) & ~mach->plic_claimed;
+    if (addr < REG_FFVM_PLIC_ENABLE || addr >= REG_FFVM_PLIC_THRESHOLD) {
+        ctx = (addr - REG_FFVM_PLIC_THRESHOLD) / 0x1000;
+        if (addr < REG_FFVM_PLIC_THRESHOLD || ctx >= 2 * mach->nharts) return 0;
+        switch (addr & 0xFFF) {
+        case REG_FFVM_PLIC_THRESHOLD & 0xFFF: return mach->plic_thres[ctx];
+        case REG_FFVM_PLIC_CLAIM     & 0xFFF: if ((id = ffvm_plic_best(mach, ctx))) mach->plic_claimed |= 1u << id; return id;
+        }
+        return 0;
+    }
+    ctx = (addr - REG_FFVM_PLIC_ENABLE) / 0x80;
+    return ctx < 2 * mach->nharts && !(addr & 0x7F) ? mach->plic_enable[ctx] : 0; // one word of enables is enough
+}
+
+static void ffvm_plic_write(RISCV *mach, uint32_t addr, uint32_t data)
+{
+    uint32_t ctx, i;
+    if (addr < REG_FFVM_PLIC_PENDING) {
+        if ((i = (addr - REG_FFVM_PLIC_PRIORITY) / 4) && i < FFVM_PLIC_SOURCES) mach->plic_prio[i] = data < FFVM_PLIC_PRIO_MAX ? data : FFVM_PLIC_PRIO_MAX;
+    } else if (addr >= REG_FFVM_PLIC_ENABLE && addr < REG_FFVM_PLIC_THRESHOLD) {
+        ctx = (addr - REG_FFVM_PLIC_ENABLE) / 0x80;
+        if (ctx < 2 * mach->nharts && !(addr & 0x7F)) mach->plic_enable[ctx] = data & ~1;
+    } else if (addr >= REG_FFVM_PLIC_THRESHOLD && (ctx = (addr - REG_FFVM_PLIC_THRESHOLD) / 0x1000) < 2 * mach->nharts) {
+        switch (addr & 0xFFF) {
+        case REG_FFVM_PLIC_THRESHOLD & 0xFFF: mach->plic_thres[ctx] = data < FFVM_PLIC_PRIO_MAX ? data : FFVM_PLIC_PRIO_MAX; break;
+        case REG_FFVM_PLIC_CLAIM     & 0xFFF: if (data < FFVM_PLIC_SOURCES && ((mach->plic_enable[ctx] >> data) & 1)) mach->plic_claimed &= ~(1u << data); break; // completion
+        }
+    }
+    for (i = 0; i < mach->nharts; i++) ffvm_irq_notify(mach->harts[i]);
+}
+
 static void ffvm_adev_callback(void *ctxt, int cmd, void *buf, int len)
 {
     RISCV *riscv = ctxt;
     switch (cmd) {
     case ADEV_CMD_DATA_RECORD:
-        if (len <= riscv->audio_in_size) {
-            uint8_t *rbuf  = &(riscv->mem[riscv->audio_in_addr % MAX_MEM_SIZE]);
+        uint8_t *rbuf = ffvm_ring_buf(riscv, riscv->audio_in_addr, riscv->audio_in_size, riscv->audio_in_head, riscv->audio_in_tail);
+        if (rbuf && len <= riscv->audio_in_size) {
             int      curr  = ringbuf_size(riscv->audio_in_head, riscv->audio_in_tail, riscv->audio_in_size);
             int      avail = riscv->audio_in_size - curr - 1;
             int      n     = avail < len ? avail : len;
@@ -252,7 +525,7 @@ static void ffvm_adev_callback(void *ctxt, int cmd, void *buf, int len)
                 curr += n;
             }
             if (curr >= riscv->irq_ain_thres && (riscv->irq_enable & (FLAG_FFVM_IRQ_AIN)) && !(riscv->irq_flags & (FLAG_FFVM_IRQ_AIN))) {
-                riscv->irq_flags |= FLAG_FFVM_IRQ_AIN;
+                ffvm_irq_raise(riscv, FLAG_FFVM_IRQ_AIN);
             }
         }
         break;
@@ -290,12 +563,35 @@ static void audio_init(RISCV *riscv, uint32_t fmt, int flag)
     }
 }
 
+static uint64_t ffvm_time_us(RISCV *riscv)
+{
+    uint64_t cycles;
+    riscv = riscv->mach; // with virtual time it follows hart 0
+    if (!riscv->vtime) return get_tick_count_us() - riscv->ffvm_start_tick;
+    if (!riscv->cpu_freq) return riscv->vtime_us;
+    cycles = riscv->mcycle - riscv->vtime_cycle;
+    return riscv->vtime_us + cycles / riscv->cpu_freq * 1000000 + cycles % riscv->cpu_freq * 1000000 / riscv->cpu_freq;
+}
+
 static void audio_update(RISCV *riscv, uint32_t counter)
 {
-    if (!riscv->audio_out_size) return;
-    uint8_t *rbuf = &(riscv->mem[riscv->audio_out_addr % MAX_MEM_SIZE]);
+    uint8_t *rbuf = ffvm_ring_buf(riscv, riscv->audio_out_addr, riscv->audio_out_size, riscv->audio_out_head, riscv->audio_out_tail);
+    if (!rbuf) return;
     int      curr = ringbuf_size(riscv->audio_out_head, riscv->audio_out_tail, riscv->audio_out_size);
-    while (adev_get(riscv->adev, "bufnum", NULL) < FFVM_ADEV_MAX_BUFNUM && curr) {
+    if (riscv->vtime) { // consume the samples due in the virtual time passed, play what the device can take, drop the rest
+        int      rate = riscv->audio_out_fmt & 0xFFFFFF, ch = riscv->audio_out_fmt >> 24;
+        uint64_t now  = ffvm_time_us(riscv);
+        int      n    = (int)(rate * now / 1000000 - rate * riscv->vtime_aout / 1000000) * ch * sizeof(int16_t);
+        riscv->vtime_aout = now;
+        n = n < curr ? n : curr;
+        n = n < riscv->adev_out_len ? n : riscv->adev_out_len;
+        if (n > 0) {
+            riscv->audio_out_head = ringbuf_read(rbuf, riscv->audio_out_size, riscv->audio_out_head, riscv->adev_out_buf, n);
+            curr -= n;
+            if (adev_get(riscv->adev, "bufnum", NULL) < FFVM_ADEV_MAX_BUFNUM) adev_play(riscv->adev, riscv->adev_out_buf, n, 0);
+        }
+    }
+    while (!riscv->vtime && adev_get(riscv->adev, "bufnum", NULL) < FFVM_ADEV_MAX_BUFNUM && curr) {
         int n = curr < riscv->adev_out_len ? curr : riscv->adev_out_len;
         if (n) {
             riscv->audio_out_head = ringbuf_read(rbuf, riscv->audio_out_size, riscv->audio_out_head, riscv->adev_out_buf, n);
@@ -304,123 +600,606 @@ static void audio_update(RISCV *riscv, uint32_t counter)
         }
     }
     if (curr <= riscv->irq_aout_thres && (riscv->irq_enable & (FLAG_FFVM_IRQ_AOUT)) && !(riscv->irq_flags & (FLAG_FFVM_IRQ_AOUT))) {
-        riscv->irq_flags |= FLAG_FFVM_IRQ_AOUT;
+        ffvm_irq_raise(riscv, FLAG_FFVM_IRQ_AOUT);
     }
 }
 
-static void ffvm_ethphy_callback(void *cbctx, char *buf, int len)
+static void ethphy_pcap_open(RISCV *riscv, char *file)
+{
+    uint32_t hdr[6] = { 0xa1b2c3d4, 2 | (4 << 16), 0, 0, 65535, 1 }; // magic, version 2.4, thiszone, sigfigs, snaplen, ethernet
+    riscv->ethphy_pcap = fopen(file, "wb");
+    if (riscv->ethphy_pcap) fwrite(hdr, sizeof(hdr), 1, riscv->ethphy_pcap);
+    else printf("failed to open %s for ethphy recording !\n", file);
+}
+
+static void ethphy_pcap_write(RISCV *riscv, void *buf, int len)
 {
-    RISCV *riscv = cbctx;
-    if (sizeof(uint32_t) + len <= riscv->ethphy_in_size) {
-        uint8_t *rbuf  = &(riscv->mem[riscv->ethphy_in_addr % MAX_MEM_SIZE]);
-        int      curr  = ringbuf_size(riscv->ethphy_in_head, riscv->ethphy_in_tail, riscv->ethphy_in_size);
-        int      avail = riscv->ethphy_in_size - curr - 1;
-        if (sizeof(uint32_t) + len <= avail) {
-            uint32_t fsize = len, tail;
-            tail = ringbuf_write(rbuf, riscv->ethphy_in_size, riscv->ethphy_in_tail, (uint8_t*)&fsize, sizeof(fsize));
-            riscv->ethphy_in_tail = ringbuf_write(rbuf, riscv->ethphy_in_size, tail, (uint8_t*) buf  , fsize        );
-            curr += sizeof(fsize) + len;
+    struct timeval tv;
+    uint32_t       rec[4];
+    if (!riscv->ethphy_pcap) return;
+    gettimeofday(&tv, NULL);
+    rec[0] = tv.tv_sec, rec[1] = tv.tv_usec, rec[2] = rec[3] = len;
+    fwrite(rec, sizeof(rec), 1, riscv->ethphy_pcap);
+    fwrite(buf, 1, len, riscv->ethphy_pcap);
+}
+
+// NULL if the ring doesn't fit in the ram or idx is outside of it
+static ETHDESC* ethphy_desc(RISCV *riscv, uint32_t addr, uint32_t num, uint32_t idx)
+{
+    ETHDESC *ring = (ETHDESC*)ffvm_mem_buf(riscv, addr, (uint64_t)num * sizeof(ETHDESC));
+    return ring && idx < num ? ring + idx : NULL;
+}
+
+static void ethphy_coal_check(RISCV *riscv)
+{
+    if (!riscv->ethphy_coal_pend) return;
+    if (  riscv->ethphy_coal_pend >= riscv->ethphy_coal_num
+       || (get_tick_count_us() - riscv->ethphy_coal_tick) >= riscv->ethphy_coal_time) {
+        riscv->ethphy_coal_pend = 0;
+        if ((riscv->irq_enable & (FLAG_FFVM_IRQ_ETHPHY)) && !(riscv->irq_flags & (FLAG_FFVM_IRQ_ETHPHY))) {
+            ffvm_irq_raise(riscv, FLAG_FFVM_IRQ_ETHPHY);
         }
+    }
+}
+
+static int ethphy_rxd_write(RISCV *riscv, uint8_t *buf, int len, int csum)
+{
+    if (!riscv->ethphy_rxd_num || !ringbuf_size(riscv->ethphy_rxd_head, riscv->ethphy_rxd_tail, riscv->ethphy_rxd_num)) return -1;
+    ETHDESC *desc = ethphy_desc(riscv, riscv->ethphy_rxd_addr, riscv->ethphy_rxd_num, riscv->ethphy_rxd_head);
+    uint8_t *dst  = desc && len <= desc->size ? ffvm_mem_buf(riscv, desc->addr, len) : NULL;
+    if (!dst) return -2;
+    memcpy(dst, buf, len);
+    desc->size   = len;
+    desc->flags  = (desc->flags & ~(FFVM_ETHPHY_DESC_CSUM | FFVM_ETHPHY_DESC_TSO)) | FFVM_ETHPHY_DESC_DONE | (csum << 1);
+    riscv->ethphy_rxd_head = (riscv->ethphy_rxd_head + 1) % riscv->ethphy_rxd_num;
+    if (riscv->ethphy_coal_pend++ == 0) riscv->ethphy_coal_tick = get_tick_count_us();
+    return 0;
+}
+
+static int ethphy_ring_write(RISCV *riscv, uint8_t *buf, int len, int csum)
+{
+    uint8_t *rbuf  = ffvm_ring_buf(riscv, riscv->ethphy_in_addr, riscv->ethphy_in_size, riscv->ethphy_in_head, riscv->ethphy_in_tail);
+    if (!rbuf || sizeof(uint32_t) + len > riscv->ethphy_in_size) return -2;
+    int      curr  = ringbuf_size(riscv->ethphy_in_head, riscv->ethphy_in_tail, riscv->ethphy_in_size);
+    int      avail = riscv->ethphy_in_size - curr - 1;
+    if (sizeof(uint32_t) + len > avail) return -1;
+    uint32_t fsize = len | (csum << 16), tail;
+    tail = ringbuf_write(rbuf, riscv->ethphy_in_size, riscv->ethphy_in_tail, (uint8_t*)&fsize, sizeof(fsize));
+    riscv->ethphy_in_tail = ringbuf_write(rbuf, riscv->ethphy_in_size, tail, buf, len);
+    return 0;
+}
+
+static void ethphy_rx_drain(RISCV *riscv)
+{
+    ETHFRAME *frame;
+    int       n = 0, ret, csum;
+    while (1) { // single consumer, peek the head frame and only release it once the guest has taken it
+        frame = &riscv->ethphy_rxq[riscv->ethphy_rxq_deq & (FFVM_ETHPHY_RXQ_SIZE - 1)];
+        if (__atomic_load_n(&frame->seq, __ATOMIC_ACQUIRE) != riscv->ethphy_rxq_deq + 1) break;
+        csum = (riscv->ethphy_offload & FFVM_ETHPHY_OFFLOAD_RXCSUM) ? net_csum_frame(frame->data, frame->len, 0) : NET_CSUM_NONE;
+        if (riscv->ethphy_mode == FFVM_ETHPHY_MODE_DESC) ret = ethphy_rxd_write(riscv, frame->data, frame->len, csum);
+        else ret = ethphy_ring_write(riscv, frame->data, frame->len, csum);
+        if (ret == -1) { // guest ring full, keep the frame queued
+            if (!riscv->ethphy_rx_stalled) riscv->ethphy_rx_stalled = 1, riscv->ethphy_rx_overruns++;
+            break;
+        }
+        if (ret == -2) __atomic_fetch_add(&riscv->ethphy_rx_drops, 1, __ATOMIC_RELAXED);
+        else { ethphy_pcap_write(riscv, frame->data, frame->len); riscv->ethphy_rx_stalled = 0; n++; }
+        __atomic_store_n(&frame->seq, riscv->ethphy_rxq_deq + FFVM_ETHPHY_RXQ_SIZE, __ATOMIC_RELEASE);
+        riscv->ethphy_rxq_deq++;
+    }
+    if (riscv->ethphy_mode == FFVM_ETHPHY_MODE_DESC) { ethphy_coal_check(riscv); return; }
+    if (n && riscv->ethphy_in_size) {
+        int curr = ringbuf_size(riscv->ethphy_in_head, riscv->ethphy_in_tail, riscv->ethphy_in_size);
         if (curr >= riscv->irq_ethp_thres && (riscv->irq_enable & (FLAG_FFVM_IRQ_ETHPHY)) && !(riscv->irq_flags & (FLAG_FFVM_IRQ_ETHPHY))) {
-            riscv->irq_flags |= FLAG_FFVM_IRQ_ETHPHY;
+            ffvm_irq_raise(riscv, FLAG_FFVM_IRQ_ETHPHY);
+        }
+    }
+}
+
+static void ethphy_tx_flush(RISCV *riscv)
+{
+    if (riscv->ethphy_txb_num) ethphy_sendv(riscv->ethphy_dev, riscv->ethphy_txb_bufs, riscv->ethphy_txb_lens, riscv->ethphy_txb_num);
+    riscv->ethphy_txb_num = 0;
+}
+
+static void ethphy_tx_queue(RISCV *riscv, uint8_t *buf, int len)
+{
+    if (riscv->ethphy_txb_num == FFVM_ETHPHY_TXD_BATCH) ethphy_tx_flush(riscv);
+    ethphy_pcap_write(riscv, buf, len);
+    riscv->ethphy_txb_bufs[riscv->ethphy_txb_num  ] = (char*)buf;
+    riscv->ethphy_txb_lens[riscv->ethphy_txb_num++] = len;
+}
+
+static void ethphy_tx_frame(RISCV *riscv, uint8_t *buf, int len, int csum, int tso)
+{
+    int mss = riscv->ethphy_tso_mss < FFVM_ETHPHY_TSO_MAXMSS ? riscv->ethphy_tso_mss : FFVM_ETHPHY_TSO_MAXMSS, segs, i;
+    if (tso && (segs = net_tso_count(buf, len, mss)) > 1) {
+        for (i = 0; i < segs; i++) {
+            if (riscv->ethphy_txb_num == FFVM_ETHPHY_TXD_BATCH) ethphy_tx_flush(riscv);
+            uint8_t *seg = riscv->ethphy_txseg[riscv->ethphy_txb_num]; // the batch slot it's queued at, free till the flush
+            ethphy_tx_queue(riscv, seg, net_tso_build(buf, len, mss, i, seg));
+        }
+        return;
+    }
+    if (csum || tso) net_csum_frame(buf, len, 1);
+    ethphy_tx_queue(riscv, buf, len);
+}
+
+static void ethphy_txd_process(RISCV *riscv)
+{
+    uint32_t head = riscv->ethphy_txd_head, tail = riscv->ethphy_txd_tail;
+    if (!riscv->ethphy_txd_num) return;
+    while (ringbuf_size(head, tail, riscv->ethphy_txd_num)) {
+        ETHDESC *desc = ethphy_desc(riscv, riscv->ethphy_txd_addr, riscv->ethphy_txd_num, head);
+        uint8_t *buf  = desc ? ffvm_mem_buf(riscv, desc->addr, desc->size) : NULL;
+        if (!desc) break;
+        if (buf) ethphy_tx_frame(riscv, buf, desc->size, // a frame outside the ram is only marked done
+            (desc->flags & FFVM_ETHPHY_DESC_CSUM) && (riscv->ethphy_offload & FFVM_ETHPHY_OFFLOAD_TXCSUM),
+            (desc->flags & FFVM_ETHPHY_DESC_TSO ) && (riscv->ethphy_offload & FFVM_ETHPHY_OFFLOAD_TSO   ));
+        desc->flags |= FFVM_ETHPHY_DESC_DONE;
+        head = (head + 1) % riscv->ethphy_txd_num;
+    }
+    ethphy_tx_flush(riscv);
+    riscv->ethphy_txd_head = head;
+}
+
+// called from the ethphy work thread, multi-producer enqueue into riscv->ethphy_rxq
+static int ffvm_ethphy_callback(void *cbctx, char *buf, int len, int retry)
+{
+    RISCV    *riscv = cbctx;
+    ETHFRAME *frame;
+    uint32_t  pos, seq;
+    int       tries = 0;
+    if (len > FFVM_ETHPHY_FRAME_MAX) goto drop;
+    pos = __atomic_load_n(&riscv->ethphy_rxq_enq, __ATOMIC_RELAXED);
+    while (1) {
+        frame = &riscv->ethphy_rxq[pos & (FFVM_ETHPHY_RXQ_SIZE - 1)];
+        seq   = __atomic_load_n(&frame->seq, __ATOMIC_ACQUIRE);
+        if ((int32_t)(seq - pos) == 0) {
+            if (__atomic_compare_exchange_n(&riscv->ethphy_rxq_enq, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) break;
+        } else if ((int32_t)(seq - pos) < 0) { // queue full, back off and give the emulation thread a chance to drain it
+            if (retry) return -1; // the backend holds on to it
+            if (++tries > 10) goto drop;
+            usleep(100);
+            pos = __atomic_load_n(&riscv->ethphy_rxq_enq, __ATOMIC_RELAXED);
+        } else {
+            pos = __atomic_load_n(&riscv->ethphy_rxq_enq, __ATOMIC_RELAXED);
         }
     }
+    memcpy(frame->data, buf, len);
+    frame->len = len;
+    __atomic_store_n(&frame->seq, pos + 1, __ATOMIC_RELEASE);
+    ffvm_wfi_kick(riscv);
+    return 0;
+
+drop:
+    __atomic_fetch_add(&riscv->ethphy_rx_drops, 1, __ATOMIC_RELAXED);
+    return 0;
 }
 
+#define RISCV_CSR_FFLAGS          0x001
+#define RISCV_CSR_FRM             0x002
+#define RISCV_CSR_FCSR            0x003
+#define RISCV_CSR_VSTART          0x008
+#define RISCV_CSR_VXSAT           0x009
+#define RISCV_CSR_VXRM            0x00A
+#define RISCV_CSR_VCSR            0x00F
+#define RISCV_CSR_VL              0xC20
+#define RISCV_CSR_VTYPE           0xC21
+#define RISCV_CSR_VLENB           0xC22
+#define RISCV_CSR_SSTATUS         0x100
+#define RISCV_CSR_SIE             0x104
+#define RISCV_CSR_STVEC           0x105
+#define RISCV_CSR_SCOUNTEREN      0x106
+#define RISCV_CSR_SEPC            0x141
+#define RISCV_CSR_SCAUSE          0x142
+#define RISCV_CSR_STVAL           0x143
+#define RISCV_CSR_SIP             0x144
+#define RISCV_CSR_SATP            0x180
 #define RISCV_CSR_MSTATUS         0x300
 #define RISCV_CSR_MISA            0x301
+#define RISCV_CSR_MEDELEG         0x302
+#define RISCV_CSR_MIDELEG         0x303
 #define RISCV_CSR_MIE             0x304
 #define RISCV_CSR_MTVEC           0x305
+#define RISCV_CSR_MCOUNTEREN      0x306
 #define RISCV_CSR_MSCRATCH        0x340
 #define RISCV_CSR_MEPC            0x341
 #define RISCV_CSR_MCAUSE          0x342
 #define RISCV_CSR_MTVAL           0x343
 #define RISCV_CSR_MIP             0x344
+#define RISCV_CSR_PMPCFG0         0x3A0
+#define RISCV_CSR_PMPADDR0        0x3B0
+#define RISCV_CSR_MHARTID         0xF14
+#define RISCV_CSR_MCYCLE          0xB00
+#define RISCV_CSR_MINSTRET        0xB02
+#define RISCV_CSR_MCYCLEH         0xB80
+#define RISCV_CSR_MINSTRETH       0xB82
+#define RISCV_CSR_CYCLE           0xC00
+#define RISCV_CSR_TIME            0xC01
+#define RISCV_CSR_INSTRET         0xC02
+#define RISCV_CSR_CYCLEH          0xC80
+#define RISCV_CSR_TIMEH           0xC81
+#define RISCV_CSR_INSTRETH        0xC82
 
+#define INTR_SUPERVISOR_SOFTWARE  1
+#define INTR_MACHINE_SOFTWARE     3
+#define INTR_SUPERVISOR_TIMER     5
 #define INTR_MACHINE_TIMER        7
+#define INTR_SUPERVISOR_EXTERNAL  9
 #define INTR_MACHINE_EXTERNAL     11
+#define RISCV_MIP_SOFT           ((1 << INTR_SUPERVISOR_SOFTWARE) | (1 << INTR_SUPERVISOR_TIMER) | (1 << INTR_SUPERVISOR_EXTERNAL)) // the bits software sets
 
-static void riscv_interrupt(RISCV *riscv)
-{
-    int source;
-    if (riscv->irq_flags) { source = INTR_MACHINE_EXTERNAL; }
-    else if (riscv->mtimecur >= riscv->mtimecmp) { source = INTR_MACHINE_TIMER; }
-    else return;
+#define RISCV_MSTATUS_SIE        (1 << 1 )
+#define RISCV_MSTATUS_MIE        (1 << 3 )
+#define RISCV_MSTATUS_SPIE       (1 << 5 )
+#define RISCV_MSTATUS_MPIE       (1 << 7 )
+#define RISCV_MSTATUS_SPP        (1 << 8 )
+#define RISCV_MSTATUS_MPP        (3 << 11)
+#define RISCV_MSTATUS_MPRV       (1 << 17)
+#define RISCV_MSTATUS_SUM        (1 << 18)
+#define RISCV_MSTATUS_MXR        (1 << 19)
+#define RISCV_MSTATUS_TVM        (1 << 20)
+#define RISCV_MSTATUS_TW         (1 << 21)
+#define RISCV_MSTATUS_TSR        (1 << 22)
+#define RISCV_MSTATUS_FS         (3 << 13) // hardwired to dirty, the fp registers are never tracked
+#define RISCV_MSTATUS_SD         (1u << 31)
+#define RISCV_SSTATUS_MASK       (RISCV_MSTATUS_SIE | RISCV_MSTATUS_SPIE | RISCV_MSTATUS_SPP | RISCV_MSTATUS_SUM | RISCV_MSTATUS_MXR | RISCV_MSTATUS_FS | RISCV_MSTATUS_SD)
 
-    if (!(riscv->csr[RISCV_CSR_MSTATUS] & (1 << 3)) ) return; // if mstatus:mie disabled
-    if (!(riscv->csr[RISCV_CSR_MIE] & (1 << source))) return; // if mie:source disabled
+#define RISCV_PRIV_U              0
+#define RISCV_PRIV_S              1
+#define RISCV_PRIV_M              3
+#define RISCV_TLB_VM              0x7 // the tlb_tab modes that translate
+#define RISCV_TLB_ALL             0xF
 
-    //+ update mstatus:mpie, mstatus:mpie = mstatus:mie
-    riscv->csr[RISCV_CSR_MSTATUS] &= ~(1 << 7);
-    riscv->csr[RISCV_CSR_MSTATUS] |= (riscv->csr[RISCV_CSR_MSTATUS] & (1 << 3)) << 4;
-    //- update mstatus:mpie, mstatus:mpie = mstatus:mie
+#define RISCV_PTE_V              (1 << 0)
+#define RISCV_PTE_R              (1 << 1)
+#define RISCV_PTE_W              (1 << 2)
+#define RISCV_PTE_X              (1 << 3)
+#define RISCV_PTE_U              (1 << 4)
+#define RISCV_PTE_A              (1 << 6)
+#define RISCV_PTE_D              (1 << 7)
 
-    riscv->csr[RISCV_CSR_MSTATUS] &= ~(1 << 3 ); // update mstatus:mie to 0
-    riscv->csr[RISCV_CSR_MIP] |= (1 << source);  // update mip:source to source
+#define EXCP_ILLEGAL_INST         2
+#define EXCP_LOAD_MISALIGNED      4
+#define EXCP_STORE_MISALIGNED     6
 
-    // update mcause
-    riscv->csr[RISCV_CSR_MCAUSE] = (1 << 31) | source; // interrupt and source
+#define RISCV_PMP_LOAD            0 // access types, also the bit of the permission in pmpcfg
+#define RISCV_PMP_STORE           1
+#define RISCV_PMP_FETCH           2
+#define RISCV_PMP_W              (1 << RISCV_PMP_STORE)
+#define RISCV_PMP_R              (1 << RISCV_PMP_LOAD )
+#define RISCV_PMP_A              (3 << 3)
+#define RISCV_PMP_TOR            (1 << 3)
+#define RISCV_PMP_L              (1 << 7)
 
-    uint32_t isr  = riscv->csr[RISCV_CSR_MTVEC] & ~0x3;
-    int      mode = riscv->csr[RISCV_CSR_MTVEC] &  0x3;
-    if (mode == 1 && (riscv->csr[RISCV_CSR_MCAUSE] & (1 << 31))) isr += 4 * (riscv->csr[RISCV_CSR_MCAUSE] & ~(1 << 31));
-    riscv->csr[RISCV_CSR_MEPC] = riscv->pc; // update mepc
-    riscv->pc = isr;
+static uint64_t ffvm_mtime(RISCV *riscv)
+{
+    uint64_t us = ffvm_time_us(riscv), freq = riscv->mach->mtime_freq;
+    return us / 1000000 * freq + us % 1000000 * freq / 1000000;
 }
 
-static uint8_t riscv_memr8(RISCV *riscv, uint32_t addr)
+// counter csrs are only brought up to date when accessed, mcycle is counted by riscv_run_slice anyway
+static void riscv_counter_sync(RISCV *riscv)
 {
-    return *(riscv->mem + (addr & (MAX_MEM_SIZE - 1)));
+    uint64_t cycle   = riscv->mcycle + riscv->cycle_off;
+    uint64_t instret = riscv->mcycle - riscv->cycle_idle + riscv->instret_off;
+    uint64_t time    = ffvm_mtime(riscv);
+    riscv->csr[RISCV_CSR_MCYCLE  ] = riscv->csr[RISCV_CSR_CYCLE  ] = (uint32_t)(cycle   >> 0 );
+    riscv->csr[RISCV_CSR_MCYCLEH ] = riscv->csr[RISCV_CSR_CYCLEH ] = (uint32_t)(cycle   >> 32);
+    riscv->csr[RISCV_CSR_MINSTRET] = riscv->csr[RISCV_CSR_INSTRET] = (uint32_t)(instret >> 0 );
+    riscv->csr[RISCV_CSR_MINSTRETH]= riscv->csr[RISCV_CSR_INSTRETH]= (uint32_t)(instret >> 32);
+    riscv->csr[RISCV_CSR_TIME    ] = (uint32_t)(time >> 0 );
+    riscv->csr[RISCV_CSR_TIMEH   ] = (uint32_t)(time >> 32);
 }
 
-static void riscv_memw8(RISCV *riscv, uint32_t addr, uint8_t data)
+// the modes are switched between by pointing tlb[] at their tlbs, with mstatus:mprv loads and stores are done in the
+// mode of mstatus:mpp, and s-mode tlbs hold the user pages while mstatus:sum allows them
+static void riscv_tlb_select(RISCV *riscv)
 {
-    *(riscv->mem + (addr & (MAX_MEM_SIZE - 1))) = data;
+    uint32_t mst  = riscv->csr[RISCV_CSR_MSTATUS];
+    uint32_t mode = (mst & RISCV_MSTATUS_MPRV) ? (mst & RISCV_MSTATUS_MPP) >> 11 : riscv->priv;
+    mode = mode == RISCV_PRIV_S && (mst & RISCV_MSTATUS_SUM) ? 2 : mode;
+    riscv->tlb[RISCV_PMP_LOAD ] = riscv->tlb_tab[mode][RISCV_PMP_LOAD ];
+    riscv->tlb[RISCV_PMP_STORE] = riscv->tlb_tab[mode][RISCV_PMP_STORE];
+    riscv->tlb[RISCV_PMP_FETCH] = riscv->tlb_tab[riscv->priv][RISCV_PMP_FETCH];
 }
 
-static uint16_t riscv_memr16(RISCV *riscv, uint32_t addr)
+// empties the tlbs of the modes in the bit mask sets, the translating ones on satp writes and sfence.vma, all of them
+// when the pmp changes. a page of sfence.vma is flushed on its own unless a superpage has been cached, which is
+// cached as the 4k pages of it that are used
+static void riscv_tlb_flush(RISCV *riscv, uint32_t sets, int page, uint32_t addr)
 {
-    if ((addr & 0x1) == 0) {
-        return *(uint16_t*)(riscv->mem + (addr & (MAX_MEM_SIZE - 1)));
-    } else {
-        return (riscv->mem[(addr + 0) & (MAX_MEM_SIZE - 1)] << 0)
-             | (riscv->mem[(addr + 1) & (MAX_MEM_SIZE - 1)] << 8);
+    int i, j;
+    if (page && !riscv->tlb_super) {
+        for (i = 0; i < 4; i++) for (j = 0; j < 3; j++) {
+            if ((sets & (1 << i)) && riscv->tlb_tab[i][j][(addr >> 12) & (RISCV_TLB_SIZE - 1)].vpn == addr >> 12) riscv->tlb_tab[i][j][(addr >> 12) & (RISCV_TLB_SIZE - 1)].vpn = RISCV_TLB_NONE;
+        }
+        return;
     }
+    for (i = 0; i < 4; i++) if (sets & (1 << i)) memset(riscv->tlb_tab[i], 0xFF, sizeof(riscv->tlb_tab[i]));
+    if ((sets & RISCV_TLB_VM) == RISCV_TLB_VM) riscv->tlb_super = 0;
 }
 
-static void riscv_memw16(RISCV *riscv, uint32_t addr, uint16_t data)
+// synchronous exception or interrupt (bit 31 of cause), taken in s-mode if it's delegated and the hart isn't in m-mode
+static void riscv_trap(RISCV *riscv, uint32_t cause, uint32_t tval)
 {
-    if ((addr & 0x1) == 0) {
-        *(uint16_t*)(riscv->mem + (addr & (MAX_MEM_SIZE - 1))) = data;
+    uint32_t code = cause & ~(1u << 31), vec, *mst = &riscv->csr[RISCV_CSR_MSTATUS];
+    riscv->mreserved = RISCV_RESERVED_NONE;
+    if (riscv->priv <= RISCV_PRIV_S && ((riscv->csr[(cause >> 31) ? RISCV_CSR_MIDELEG : RISCV_CSR_MEDELEG] >> code) & 1)) {
+        //+ sstatus:spp = priv, sstatus:spie = sstatus:sie, sstatus:sie = 0
+        *mst = (*mst & ~(RISCV_MSTATUS_SPP | RISCV_MSTATUS_SPIE | RISCV_MSTATUS_SIE)) | (riscv->priv << 8) | ((*mst & RISCV_MSTATUS_SIE) << 4);
+        riscv->csr[RISCV_CSR_SCAUSE] = cause;
+        riscv->csr[RISCV_CSR_SEPC  ] = riscv->pc;
+        riscv->csr[RISCV_CSR_STVAL ] = tval;
+        riscv->priv = RISCV_PRIV_S;
+        vec = riscv->csr[RISCV_CSR_STVEC];
     } else {
-        riscv->mem[(addr + 0) & (MAX_MEM_SIZE - 1)] = (uint8_t)(data >> 0);
-        riscv->mem[(addr + 1) & (MAX_MEM_SIZE - 1)] = (uint8_t)(data >> 8);
+        //+ mstatus:mpp = priv, mstatus:mpie = mstatus:mie, mstatus:mie = 0
+        *mst = (*mst & ~(RISCV_MSTATUS_MPP | RISCV_MSTATUS_MPIE | RISCV_MSTATUS_MIE)) | (riscv->priv << 11) | ((*mst & RISCV_MSTATUS_MIE) << 4);
+        riscv->csr[RISCV_CSR_MCAUSE] = cause;
+        riscv->csr[RISCV_CSR_MEPC  ] = riscv->pc;
+        riscv->csr[RISCV_CSR_MTVAL ] = tval;
+        riscv->priv = RISCV_PRIV_M;
+        vec = riscv->csr[RISCV_CSR_MTVEC];
     }
+    riscv->pc = (vec & ~0x3) + ((vec & 0x3) == 1 && (cause >> 31) ? 4 * code : 0);
+    riscv_tlb_select(riscv);
 }
 
-static uint32_t riscv_memr32(RISCV *riscv, uint32_t addr)
+// the faulting access never completes, nor does the rest of the instruction, so rd is left alone
+static __attribute__((noreturn)) void riscv_fault(RISCV *riscv, uint32_t cause, uint32_t tval)
 {
-    if (addr < REG_FFVM_STDIO) {
-        if ((addr & 0x3) == 0) {
-            return *(uint32_t*)(riscv->mem + (addr & (MAX_MEM_SIZE - 1)));
-        } else {
-            return (riscv->mem[(addr + 0) & (MAX_MEM_SIZE - 1)] << 0)
-                 | (riscv->mem[(addr + 1) & (MAX_MEM_SIZE - 1)] << 8)
-                 | (riscv->mem[(addr + 2) & (MAX_MEM_SIZE - 1)] <<16)
-                 | (riscv->mem[(addr + 3) & (MAX_MEM_SIZE - 1)] <<24);
+    riscv_trap(riscv, cause, tval);
+    longjmp(riscv->trap_jmp, 1);
+}
+
+// mip, the machine bits follow the clint and the plic m-mode context of the hart, the supervisor ones are set by
+// software, seip is also raised by the s-mode context
+static uint32_t riscv_mip(RISCV *riscv)
+{
+    uint32_t mip = __atomic_load_n(&riscv->mip_soft, __ATOMIC_RELAXED), ctx = 2 * riscv->csr[RISCV_CSR_MHARTID];
+    if (riscv->msip) mip |= 1 << INTR_MACHINE_SOFTWARE;
+    if (riscv->mtimecur >= riscv->mtimecmp) mip |= riscv->mtip;
+    if (ffvm_plic_best(riscv->mach, ctx + 0)) mip |= 1 << INTR_MACHINE_EXTERNAL;
+    if (ffvm_plic_best(riscv->mach, ctx + 1)) mip |= 1 << INTR_SUPERVISOR_EXTERNAL;
+    return riscv->csr[RISCV_CSR_MIP] = mip;
+}
+
+// takes the highest priority interrupt pending and enabled in mie. the ones for m-mode are taken in a lower mode or
+// with mstatus:mie, the ones mideleg gives to s-mode in u-mode or in s-mode with mstatus:sie, never in m-mode
+static void riscv_interrupt(RISCV *riscv)
+{
+    static const int s_order[] = { INTR_MACHINE_EXTERNAL, INTR_MACHINE_SOFTWARE, INTR_MACHINE_TIMER, INTR_SUPERVISOR_EXTERNAL, INTR_SUPERVISOR_SOFTWARE, INTR_SUPERVISOR_TIMER };
+    uint32_t pend, deleg = riscv->csr[RISCV_CSR_MIDELEG], mst = riscv->csr[RISCV_CSR_MSTATUS], take = 0, i;
+    if (riscv->tlb_shoot) riscv_tlb_flush(riscv, RISCV_TLB_VM, 0, 0), __atomic_store_n(&riscv->tlb_shoot, 0, __ATOMIC_RELEASE);
+    if (riscv->hsm || !(pend = riscv_mip(riscv) & riscv->csr[RISCV_CSR_MIE])) return;
+    if (riscv->priv < RISCV_PRIV_M || (mst & RISCV_MSTATUS_MIE)) take = pend & ~deleg;
+    if (!take && (riscv->priv < RISCV_PRIV_S || (riscv->priv == RISCV_PRIV_S && (mst & RISCV_MSTATUS_SIE)))) take = pend & deleg;
+    for (i = 0; i < sizeof(s_order) / sizeof(s_order[0]); i++) {
+        if (take & (1 << s_order[i])) { riscv_trap(riscv, (1u << 31) | s_order[i], 0); return; }
+    }
+}
+
+static uint32_t riscv_pmp_cfg(RISCV *riscv, int i) { return (riscv->csr[RISCV_CSR_PMPCFG0 + i / 4] >> (i % 4 * 8)) & 0xFF; }
+
+// the range [*lo, *hi) entry i matches, 0 if it's off
+static int riscv_pmp_range(RISCV *riscv, int i, uint64_t *lo, uint64_t *hi)
+{
+    uint64_t a = riscv->csr[RISCV_CSR_PMPADDR0 + i], m;
+    switch ((riscv_pmp_cfg(riscv, i) & RISCV_PMP_A) >> 3) {
+    case 1: *lo = i ? (uint64_t)riscv->csr[RISCV_CSR_PMPADDR0 + i - 1] << 2 : 0; *hi = a << 2; return 1; // tor
+    case 2: *lo = a << 2; *hi = *lo + 4; return 1; // na4
+    case 3: m = a ^ (a + 1); *lo = (a & ~m) << 2; *hi = *lo + ((m + 1) << 2); return 1; // napot
+    }
+    return 0;
+}
+
+// in m-mode an entry applies once it's locked and what none of them matches is allowed, in s-mode and u-mode all of
+// them apply and what none matches is denied, unless all the entries are off. returns 0 if the access of the type
+// at physical addr isn't allowed, 2 if the outcome is the same for the whole page so the page can go in the tlb:
+// the entry that matches less the higher priority ones around it covers the page, and it's ram below the mmio
+static int riscv_pmp_allow(RISCV *riscv, uint32_t addr, uint32_t type, uint32_t mode)
+{
+    uint64_t lo = 0, hi = REG_FFVM_STDIO, b, t, page = addr & ~0xFFF;
+    uint32_t cfg, perm = mode == RISCV_PRIV_M || !riscv->pmp_num ? 0xFF : 0;
+    int      i;
+    for (i = 0; i < (int)riscv->pmp_num; i++) {
+        cfg = riscv_pmp_cfg(riscv, i);
+        if ((mode == RISCV_PRIV_M && !(cfg & RISCV_PMP_L)) || !riscv_pmp_range(riscv, i, &b, &t)) continue;
+        if (addr >= b && addr < t) { lo = lo > b ? lo : b; hi = hi < t ? hi : t; perm = cfg; break; }
+        if (t <= addr) lo = lo > t ? lo : t;
+        else           hi = hi < b ? hi : b;
+    }
+    if (!(perm & (1 << type))) return 0;
+    return lo <= page && hi >= page + 0x1000 ? 2 : 1;
+}
+
+// locked entries ignore writes, and so does the address of the entry below a locked tor one
+static void riscv_pmp_write(RISCV *riscv, uint32_t csr, uint32_t old)
+{
+    int i;
+    if (csr < RISCV_CSR_PMPCFG0 + RISCV_PMP_ENTRIES / 4) {
+        for (i = 0; i < 4; i++) {
+            if (old & (RISCV_PMP_L << i * 8)) riscv->csr[csr] = (riscv->csr[csr] & ~(0xFFu << i * 8)) | (old & (0xFFu << i * 8));
+            if ((riscv->csr[csr] & ((RISCV_PMP_R | RISCV_PMP_W) << i * 8)) == (RISCV_PMP_W << i * 8)) riscv->csr[csr] &= ~(RISCV_PMP_W << i * 8); // w without r is reserved
+            riscv->csr[csr] &= ~(0x60u << i * 8);
         }
+    } else if (csr < RISCV_CSR_PMPADDR0) {
+        riscv->csr[csr] = 0;
+    } else {
+        i = csr - RISCV_CSR_PMPADDR0;
+        if ((riscv_pmp_cfg(riscv, i) & RISCV_PMP_L) || (i + 1 < RISCV_PMP_ENTRIES
+           && (riscv_pmp_cfg(riscv, i + 1) & (RISCV_PMP_L | RISCV_PMP_A)) == (RISCV_PMP_L | RISCV_PMP_TOR))) riscv->csr[csr] = old;
+    }
+    for (riscv->pmp_num = i = 0; i < RISCV_PMP_ENTRIES; i++) if (riscv_pmp_cfg(riscv, i) & RISCV_PMP_A) riscv->pmp_num = i + 1;
+    riscv_tlb_flush(riscv, RISCV_TLB_ALL, 0, 0);
+}
+
+// sv32 page table walk for an access of the type in the mode, a and d are set in the pte by the walk. returns the
+// physical address, *super is set for a superpage
+static uint32_t riscv_walk(RISCV *riscv, uint32_t addr, uint32_t type, uint32_t mode, int *super)
+{
+    static const uint32_t s_page[3] = { 13, 15, 12 }, s_access[3] = { 5, 7, 1 }; // load, store/amo, instruction page and access faults
+    uint32_t mst = riscv->csr[RISCV_CSR_MSTATUS], pte, *p;
+    uint64_t base = (uint64_t)(riscv->csr[RISCV_CSR_SATP] & 0x3FFFFF) << 12, pa;
+    int      level;
+    for (level = 1; ; level--) {
+        pa = base + ((addr >> (12 + 10 * level)) & 0x3FF) * 4;
+        if (pa >= REG_FFVM_STDIO) riscv_fault(riscv, s_access[type], addr);
+        p   = (uint32_t*)(riscv->mem + (pa & riscv->mem_mask));
+        pte = __atomic_load_n(p, __ATOMIC_RELAXED);
+        if (!(pte & RISCV_PTE_V) || (pte & (RISCV_PTE_R | RISCV_PTE_W)) == RISCV_PTE_W) riscv_fault(riscv, s_page[type], addr);
+        if (pte & (RISCV_PTE_R | RISCV_PTE_X)) break;
+        if (!level) riscv_fault(riscv, s_page[type], addr);
+        base = (uint64_t)(pte >> 10) << 12;
+    }
+    if (mode == RISCV_PRIV_U ? !(pte & RISCV_PTE_U) : (pte & RISCV_PTE_U) && (type == RISCV_PMP_FETCH || !(mst & RISCV_MSTATUS_SUM))) riscv_fault(riscv, s_page[type], addr);
+    if (!(pte & (RISCV_PTE_R << type)) && !(type == RISCV_PMP_LOAD && (mst & RISCV_MSTATUS_MXR) && (pte & RISCV_PTE_X))) riscv_fault(riscv, s_page[type], addr);
+    if (level && ((pte >> 10) & 0x3FF)) riscv_fault(riscv, s_page[type], addr); // misaligned superpage
+    if (!(pte & RISCV_PTE_A) || (type == RISCV_PMP_STORE && !(pte & RISCV_PTE_D))) __atomic_fetch_or(p, RISCV_PTE_A | (type == RISCV_PMP_STORE ? RISCV_PTE_D : 0), __ATOMIC_RELAXED);
+    pa = level ? ((uint64_t)(pte >> 20) << 22) | (addr & 0x3FFFFF) : ((uint64_t)(pte >> 10) << 12) | (addr & 0xFFF);
+    if (pa >> 32) riscv_fault(riscv, s_access[type], addr);
+    *super = level;
+    return (uint32_t)pa;
+}
+
+// the tlb miss path, translates with satp in s-mode and u-mode, checks the pmp and fills the tlb entry for a page
+// of plain ram. returns the physical address, it's mmio if above REG_FFVM_STDIO
+static uint32_t riscv_translate(RISCV *riscv, uint32_t addr, uint32_t type)
+{
+    static const uint32_t s_access[3] = { 5, 7, 1 };
+    uint32_t mst  = riscv->csr[RISCV_CSR_MSTATUS], pa = addr;
+    uint32_t mode = type != RISCV_PMP_FETCH && (mst & RISCV_MSTATUS_MPRV) ? (mst & RISCV_MSTATUS_MPP) >> 11 : riscv->priv;
+    TLBENTRY *e   = &riscv->tlb[type][(addr >> 12) & (RISCV_TLB_SIZE - 1)];
+    int       super = 0, ok;
+    if (mode != RISCV_PRIV_M && (riscv->csr[RISCV_CSR_SATP] >> 31)) pa = riscv_walk(riscv, addr, type, mode, &super);
+    if (!(ok = riscv_pmp_allow(riscv, pa, type, mode))) riscv_fault(riscv, s_access[type], addr);
+    if (ok == 2) {
+        e->vpn    = addr >> 12;
+        e->addend = (uintptr_t)(riscv->mem + (pa & riscv->mem_mask & ~0xFFF)) - (addr & ~0xFFF);
+        riscv->tlb_super |= super;
     }
+    return pa;
+}
+
+static inline TLBENTRY* riscv_tlb(RISCV *riscv, uint32_t type, uint32_t addr) { return &riscv->tlb[type][(addr >> 12) & (RISCV_TLB_SIZE - 1)]; }
+
+// a store to a reserved word kills the reservation for every hart, normally it's one compare that misses.
+// reservations are by ram offset, so the word is the same whatever address it's mapped at
+static inline void riscv_resv_kill(RISCV *riscv, uint32_t off)
+{
+    uint32_t *slot = &riscv->reserved[(off >> 2) & (RISCV_RESERVED_SLOTS - 1)];
+    if (__atomic_load_n(slot, __ATOMIC_RELAXED) == (off & ~0x3)) __atomic_store_n(slot, RISCV_RESERVED_NONE, __ATOMIC_RELAXED);
+}
+
+// the accessors inline the common case only, an aligned access that hits in the tlb of its type takes one predicted
+// branch on the entry tag and a single host load or store, sp relative ones included. the tlb only holds plain ram
+// pages, so the slow path out of line has the page walk and the pmp, misaligned accesses byte wise and the mmio
+// through the machine lock. bytes and halfwords of the mmio are the ram below it as they always were
+static __attribute__((noinline)) uint8_t riscv_memr8_slow(RISCV *riscv, uint32_t addr)
+{
+    return riscv->mem[riscv_translate(riscv, addr, RISCV_PMP_LOAD) & riscv->mem_mask];
+}
+
+static __attribute__((noinline)) void riscv_memw8_slow(RISCV *riscv, uint32_t addr, uint8_t data)
+{
+    uint32_t off = riscv_translate(riscv, addr, RISCV_PMP_STORE) & riscv->mem_mask;
+    riscv->mem[off] = data;
+    riscv_resv_kill(riscv, off);
+}
+
+static inline uint8_t riscv_memr8(RISCV *riscv, uint32_t addr)
+{
+    TLBENTRY *e = riscv_tlb(riscv, RISCV_PMP_LOAD, addr);
+    if (e->vpn == addr >> 12) return *(uint8_t*)(e->addend + addr);
+    return riscv_memr8_slow(riscv, addr);
+}
+
+static inline void riscv_memw8(RISCV *riscv, uint32_t addr, uint8_t data)
+{
+    TLBENTRY *e = riscv_tlb(riscv, RISCV_PMP_STORE, addr);
+    if (e->vpn != addr >> 12) { riscv_memw8_slow(riscv, addr, data); return; }
+    *(uint8_t*)(e->addend + addr) = data;
+    riscv_resv_kill(riscv, e->addend + addr - (uintptr_t)riscv->mem);
+}
+
+static __attribute__((noinline)) uint16_t riscv_memr16_slow(RISCV *riscv, uint32_t addr)
+{
+    if (addr & 0x1) return riscv_memr8(riscv, addr) | (riscv_memr8(riscv, addr + 1) << 8);
+    return *(uint16_t*)(riscv->mem + (riscv_translate(riscv, addr, RISCV_PMP_LOAD) & riscv->mem_mask));
+}
+
+static __attribute__((noinline)) void riscv_memw16_slow(RISCV *riscv, uint32_t addr, uint16_t data)
+{
+    uint32_t off;
+    if (addr & 0x1) { riscv_memw8(riscv, addr, (uint8_t)(data >> 0)); riscv_memw8(riscv, addr + 1, (uint8_t)(data >> 8)); return; }
+    off = riscv_translate(riscv, addr, RISCV_PMP_STORE) & riscv->mem_mask;
+    *(uint16_t*)(riscv->mem + off) = data;
+    riscv_resv_kill(riscv, off);
+}
+
+static inline uint16_t riscv_memr16(RISCV *riscv, uint32_t addr)
+{
+    TLBENTRY *e = riscv_tlb(riscv, RISCV_PMP_LOAD, addr);
+    if (!(addr & 0x1) && e->vpn == addr >> 12) return *(uint16_t*)(e->addend + addr);
+    return riscv_memr16_slow(riscv, addr);
+}
+
+static inline void riscv_memw16(RISCV *riscv, uint32_t addr, uint16_t data)
+{
+    TLBENTRY *e = riscv_tlb(riscv, RISCV_PMP_STORE, addr);
+    if ((addr & 0x1) || e->vpn != addr >> 12) { riscv_memw16_slow(riscv, addr, data); return; }
+    *(uint16_t*)(e->addend + addr) = data;
+    riscv_resv_kill(riscv, e->addend + addr - (uintptr_t)riscv->mem);
+}
+
+// the clint has the msip and mtimecmp of every hart, the latter are the same as their REG_FFVM_MTIMECMPL/H
+static uint32_t ffvm_clint_read(RISCV *mach, uint32_t addr)
+{
+    uint32_t hart;
+    if (addr >= REG_FFVM_CLINT_MTIME) return ffvm_mtime(mach) >> (addr & 0x4 ? 32 : 0);
+    if (addr >= REG_FFVM_CLINT_MTIMECMP) return (hart = (addr - REG_FFVM_CLINT_MTIMECMP) / 8) < mach->nharts ? mach->harts[hart]->mtimecmp >> (addr & 0x4 ? 32 : 0) : 0;
+    if (addr < REG_FFVM_CLINT_MSIP + 4 * FFVM_MAX_HARTS) return (hart = (addr - REG_FFVM_CLINT_MSIP) / 4) < mach->nharts ? mach->harts[hart]->msip : 0;
+    return 0;
+}
+
+static void ffvm_clint_write(RISCV *riscv, uint32_t addr, uint32_t data)
+{
+    RISCV   *hart;
+    uint32_t i;
+    if (addr >= REG_FFVM_CLINT_MTIME) return; // mtime follows the host clock or the virtual time
+    if (addr >= REG_FFVM_CLINT_MTIMECMP) i = (addr - REG_FFVM_CLINT_MTIMECMP) / 8;
+    else if (addr < REG_FFVM_CLINT_MSIP + 4 * FFVM_MAX_HARTS) i = (addr - REG_FFVM_CLINT_MSIP) / 4;
+    else return;
+    if (i >= riscv->mach->nharts) return;
+    hart = riscv->mach->harts[i];
+    if (addr >= REG_FFVM_CLINT_MTIMECMP) ((uint32_t*)&hart->mtimecmp)[(addr >> 2) & 1] = data, riscv_slice_break(hart);
+    else hart->msip = data & 1;
+    if (hart == riscv) riscv->irq_pending = 1;
+    else ffvm_irq_notify(hart);
+}
 
-    if (addr == REG_FFVM_MTIMECURL || addr == REG_FFVM_MTIMECURH) riscv->mtimecur = get_tick_count() - riscv->ffvm_start_tick;
+// the timer registers are the accessing hart's own, everything else is hart 0's. the clint and the plic are shared
+static uint32_t ffvm_mmio_read(RISCV *riscv, uint32_t addr)
+{
+    if (addr >= REG_FFVM_CLINT_MSIP    && addr < REG_FFVM_CLINT_END) return ffvm_clint_read(riscv->mach, addr);
+    if (addr >= REG_FFVM_PLIC_PRIORITY && addr < REG_FFVM_PLIC_END ) return ffvm_plic_read (riscv->mach, addr);
+    if (addr == REG_FFVM_MTIMECURL || addr == REG_FFVM_MTIMECURH) riscv->mtimecur = ffvm_mtime(riscv);
     switch (addr) {
-    case REG_FFVM_STDIO    : return console_getc ();
-    case REG_FFVM_GETCH    : return console_getch();
-    case REG_FFVM_KBHIT    : return console_kbhit();
-    case REG_FFVM_REALTIME : return time(NULL) - riscv->ffvm_realtime_diff;
     case REG_FFVM_MTIMECURL: return riscv->mtimecur >>  0;
     case REG_FFVM_MTIMECURH: return riscv->mtimecur >> 32;
     case REG_FFVM_MTIMECMPL: return riscv->mtimecmp >>  0;
     case REG_FFVM_MTIMECMPH: return riscv->mtimecmp >> 32;
+    }
+    riscv = riscv->mach;
+    switch (addr) {
+    case REG_FFVM_STDIO    : return console_getc ();
+    case REG_FFVM_GETCH    : return console_getch();
+    case REG_FFVM_KBHIT    : return console_kbhit();
+    case REG_FFVM_REALTIME : return (riscv->vtime ? riscv->ffvm_start_time + ffvm_time_us(riscv) / 1000000 : time(NULL)) - riscv->ffvm_realtime_diff;
+    case REG_FFVM_MTIME_FREQ: return riscv->mtime_freq;
     case REG_FFVM_MOUSE_XY : return (riscv->idev->mouse_x << 0) | (riscv->idev->mouse_y << 16);
     case REG_FFVM_MOUSE_BTN: return (riscv->idev->mouse_btns);
     case REG_FFVM_DISK_SECTOR_NUM : return get_file_size(riscv->disk_fp) / RISCV_DISK_SECTSIZE;
@@ -432,24 +1211,46 @@ static uint32_t riscv_memr32(RISCV *riscv, uint32_t addr)
     if (addr >= REG_FFVM_AUDIO_OUT_FMT   && addr <= REG_FFVM_AUDIO_OUT_SIZE) return *(&riscv->audio_out_fmt  + (addr - REG_FFVM_AUDIO_OUT_FMT  ) / sizeof(uint32_t));
     if (addr >= REG_FFVM_AUDIO_IN_FMT    && addr <= REG_FFVM_AUDIO_IN_SIZE ) return *(&riscv->audio_in_fmt   + (addr - REG_FFVM_AUDIO_IN_FMT   ) / sizeof(uint32_t));
     if (addr >= REG_FFVM_CPU_FREQ        && addr <= REG_FFVM_IRQ_ETHP_THRES) return *(&riscv->cpu_freq       + (addr - REG_FFVM_CPU_FREQ       ) / sizeof(uint32_t));
-    if (addr >= REG_FFVM_ETHPHY_OUT_ADDR && addr <= REG_FFVM_ETHPHY_IN_SIZE) return *(&riscv->ethphy_out_addr+ (addr - REG_FFVM_ETHPHY_OUT_ADDR) / sizeof(uint32_t));
+    if (addr >= REG_FFVM_ETHPHY_OUT_ADDR && addr <= REG_FFVM_ETHPHY_TSO_MSS) return *(&riscv->ethphy_out_addr+ (addr - REG_FFVM_ETHPHY_OUT_ADDR) / sizeof(uint32_t));
     return 0;
 }
 
-static void riscv_memw32(RISCV *riscv, uint32_t addr, uint32_t data)
+static __attribute__((noinline)) uint32_t riscv_memr32_slow(RISCV *riscv, uint32_t addr)
 {
-    if (addr < REG_FFVM_STDIO) {
-        if ((addr & 0x3) == 0) {
-            *(uint32_t*)(riscv->mem + (addr & (MAX_MEM_SIZE - 1))) = data;
-        } else {
-            riscv->mem[(addr + 0) & (MAX_MEM_SIZE - 1)] = (uint8_t)(data >> 0);
-            riscv->mem[(addr + 1) & (MAX_MEM_SIZE - 1)] = (uint8_t)(data >> 8);
-            riscv->mem[(addr + 2) & (MAX_MEM_SIZE - 1)] = (uint8_t)(data >>16);
-            riscv->mem[(addr + 3) & (MAX_MEM_SIZE - 1)] = (uint8_t)(data >>24);
-        }
-        return;
+    uint32_t data, pa;
+    if (addr & 0x3) {
+        data  = riscv_memr8(riscv, addr + 0) << 0;
+        data |= riscv_memr8(riscv, addr + 1) << 8;
+        data |= riscv_memr8(riscv, addr + 2) <<16;
+        data |= riscv_memr8(riscv, addr + 3) <<24;
+        return data;
     }
+    pa = riscv_translate(riscv, addr, RISCV_PMP_LOAD);
+    if (pa < REG_FFVM_STDIO) return *(uint32_t*)(riscv->mem + (pa & riscv->mem_mask));
+    ffvm_lock(riscv);
+    data = ffvm_mmio_read(riscv, pa);
+    ffvm_unlock(riscv);
+    return data;
+}
+
+static inline uint32_t riscv_memr32(RISCV *riscv, uint32_t addr)
+{
+    TLBENTRY *e = riscv_tlb(riscv, RISCV_PMP_LOAD, addr);
+    if (!(addr & 0x3) && e->vpn == addr >> 12) return *(uint32_t*)(e->addend + addr);
+    return riscv_memr32_slow(riscv, addr);
+}
 
+static void ffvm_mmio_write(RISCV *riscv, uint32_t addr, uint32_t data)
+{
+    RISCV   *hart = riscv;
+    uint8_t *buf;
+    if (addr >= REG_FFVM_CLINT_MSIP    && addr < REG_FFVM_CLINT_END) { ffvm_clint_write(riscv, addr, data); return; }
+    if (addr >= REG_FFVM_PLIC_PRIORITY && addr < REG_FFVM_PLIC_END ) { ffvm_plic_write(riscv->mach, addr, data); return; }
+    switch (addr) {
+    case REG_FFVM_MTIMECMPL: ((uint32_t*)&riscv->mtimecmp)[0] = data; riscv->irq_pending = 1; riscv_slice_break(riscv); return;
+    case REG_FFVM_MTIMECMPH: ((uint32_t*)&riscv->mtimecmp)[1] = data; riscv->irq_pending = 1; riscv_slice_break(riscv); return;
+    }
+    riscv = riscv->mach;
     switch (addr) {
     case REG_FFVM_STDIO  : if (data == (uint32_t)-1) fflush(stdout); else fputc(data, stdout); return;
     case REG_FFVM_STDERR : if (data == (uint32_t)-1) fflush(stderr); else fputc(data, stderr); return;
@@ -458,13 +1259,22 @@ static void riscv_memw32(RISCV *riscv, uint32_t addr, uint32_t data)
     case REG_FFVM_DISP_WH: disp_init(riscv, data); break;
     case REG_FFVM_AUDIO_OUT_FMT: audio_init(riscv, data, 0); break;
     case REG_FFVM_AUDIO_IN_FMT : audio_init(riscv, data, 1); break;
-    case REG_FFVM_REALTIME : riscv->ffvm_realtime_diff = time(NULL) - data; return;
-    case REG_FFVM_MTIMECMPL: ((uint32_t*)&riscv->mtimecmp)[0] = data; return;
-    case REG_FFVM_MTIMECMPH: ((uint32_t*)&riscv->mtimecmp)[1] = data; return;
+    case REG_FFVM_REALTIME : riscv->ffvm_realtime_diff = (riscv->vtime ? riscv->ffvm_start_time + ffvm_time_us(riscv) / 1000000 : time(NULL)) - data; return;
+    case REG_FFVM_IRQ_FLAGS: riscv->irq_pending = 1; break;
+    case REG_FFVM_MTIME_FREQ: riscv->mtime_freq = data < FFVM_MTIME_FREQ_MIN ? FFVM_MTIME_FREQ_MIN : data > FFVM_MTIME_FREQ_MAX ? FFVM_MTIME_FREQ_MAX : data; return;
     case REG_FFVM_DISK_SECTOR_IDX: fseeko(riscv->disk_fp, data * RISCV_DISK_SECTSIZE, SEEK_SET); return;
     case REG_FFVM_DISK_SECTOR_DAT: fputc(data, riscv->disk_fp); return;
-    case REG_FFVM_CPU_FREQ: data = data < RISCV_CPU_FREQ_MAX ? data : RISCV_CPU_FREQ_MAX; break;
-    case REG_FFVM_ETHPHY_OUT_SIZE: ethphy_send(riscv->ethphy_dev, (char*)riscv->mem + (riscv->ethphy_out_addr & (MAX_MEM_SIZE - 1)), data); break;
+    case REG_FFVM_CPU_FREQ:
+        data = data < RISCV_CPU_FREQ_MAX ? data : RISCV_CPU_FREQ_MAX;
+        if (riscv->vtime) riscv->vtime_us = ffvm_time_us(riscv), riscv->vtime_cycle = riscv->mcycle;
+        riscv_slice_break(hart); // the other harts pick it up with their next slice
+        break;
+    case REG_FFVM_ETHPHY_OUT_SIZE:
+        if ((buf = ffvm_mem_buf(riscv, riscv->ethphy_out_addr, data))) ethphy_tx_frame(riscv, buf, data,
+            riscv->ethphy_offload & FFVM_ETHPHY_OFFLOAD_TXCSUM, riscv->ethphy_offload & FFVM_ETHPHY_OFFLOAD_TSO);
+        ethphy_tx_flush(riscv);
+        break;
+    case REG_FFVM_ETHPHY_TXD_TAIL: riscv->ethphy_txd_tail = data; ethphy_txd_process(riscv); return;
     }
     if (addr >= REG_FFVM_DISP_ADDR && addr <= REG_FFVM_DISP_BITBLT_WH) {
         *(&riscv->disp_addr + (addr - REG_FFVM_DISP_ADDR) / sizeof(uint32_t)) = data;
@@ -473,7 +1283,46 @@ static void riscv_memw32(RISCV *riscv, uint32_t addr, uint32_t data)
     else if (addr >= REG_FFVM_AUDIO_OUT_ADDR  && addr <= REG_FFVM_AUDIO_OUT_SIZE) *(&riscv->audio_out_addr + (addr - REG_FFVM_AUDIO_OUT_ADDR ) / sizeof(uint32_t)) = data;
     else if (addr >= REG_FFVM_AUDIO_IN_ADDR   && addr <= REG_FFVM_AUDIO_IN_SIZE ) *(&riscv->audio_in_addr  + (addr - REG_FFVM_AUDIO_IN_ADDR  ) / sizeof(uint32_t)) = data;
     else if (addr >= REG_FFVM_CPU_FREQ        && addr <= REG_FFVM_IRQ_ETHP_THRES) *(&riscv->cpu_freq       + (addr - REG_FFVM_CPU_FREQ       ) / sizeof(uint32_t)) = data;
-    else if (addr >= REG_FFVM_ETHPHY_OUT_ADDR && addr <= REG_FFVM_ETHPHY_IN_SIZE) *(&riscv->ethphy_out_addr+ (addr - REG_FFVM_ETHPHY_OUT_ADDR) / sizeof(uint32_t)) = data;
+    else if (addr >= REG_FFVM_ETHPHY_OUT_ADDR && addr <= REG_FFVM_ETHPHY_TSO_MSS) *(&riscv->ethphy_out_addr+ (addr - REG_FFVM_ETHPHY_OUT_ADDR) / sizeof(uint32_t)) = data;
+}
+
+static __attribute__((noinline)) void riscv_memw32_slow(RISCV *riscv, uint32_t addr, uint32_t data)
+{
+    uint32_t pa;
+    if (addr & 0x3) {
+        riscv_memw8(riscv, addr + 0, (uint8_t)(data >> 0));
+        riscv_memw8(riscv, addr + 1, (uint8_t)(data >> 8));
+        riscv_memw8(riscv, addr + 2, (uint8_t)(data >>16));
+        riscv_memw8(riscv, addr + 3, (uint8_t)(data >>24));
+        return;
+    }
+    pa = riscv_translate(riscv, addr, RISCV_PMP_STORE);
+    if (pa < REG_FFVM_STDIO) {
+        *(uint32_t*)(riscv->mem + (pa & riscv->mem_mask)) = data;
+        riscv_resv_kill(riscv, pa & riscv->mem_mask);
+        return;
+    }
+    ffvm_lock(riscv);
+    ffvm_mmio_write(riscv, pa, data);
+    ffvm_unlock(riscv);
+}
+
+static inline void riscv_memw32(RISCV *riscv, uint32_t addr, uint32_t data)
+{
+    TLBENTRY *e = riscv_tlb(riscv, RISCV_PMP_STORE, addr);
+    if ((addr & 0x3) || e->vpn != addr >> 12) { riscv_memw32_slow(riscv, addr, data); return; }
+    *(uint32_t*)(e->addend + addr) = data;
+    riscv_resv_kill(riscv, e->addend + addr - (uintptr_t)riscv->mem);
+}
+
+// host pointer of the ram an access of the type at addr goes to, NULL for the mmio
+static uint8_t* riscv_host(RISCV *riscv, uint32_t addr, uint32_t type)
+{
+    TLBENTRY *e = riscv_tlb(riscv, type, addr);
+    uint32_t pa;
+    if (e->vpn == addr >> 12) return (uint8_t*)(e->addend + addr);
+    pa = riscv_translate(riscv, addr, type);
+    return pa < REG_FFVM_STDIO ? riscv->mem + (pa & riscv->mem_mask) : NULL;
 }
 
 static int32_t signed_extend(uint32_t a, int size)
@@ -481,7 +1330,261 @@ static int32_t signed_extend(uint32_t a, int size)
     return (a & (1 << (size - 1))) ? (a | ~((1 << size) - 1)) : a;
 }
 
-static void riscv_execute_rv16(RISCV *riscv, uint16_t instruction)
+static uint32_t riscv_amo_op(uint32_t op, uint32_t a, uint32_t b)
+{
+    switch (op) {
+    case 0x01: return b;     // amoswap.w
+    case 0x00: return a + b; // amoadd.w
+    case 0x04: return a ^ b; // amoxor.w
+    case 0x0c: return a & b; // amoand.w
+    case 0x08: return a | b; // amoor.w
+    case 0x10: return (int32_t)a < (int32_t)b ? a : b; // amomin.w
+    case 0x14: return (int32_t)a > (int32_t)b ? a : b; // amomax.w
+    case 0x18: return a < b ? a : b; // amominu.w
+    case 0x1c: return a > b ? a : b; // amomaxu.w
+    }
+    return a;
+}
+
+// rv32a. lr.w reserves the word for the hart and publishes it in the machine's reservation table, any store to it
+// or a trap or mret on the hart kills it, sc.w claims it back from the table and stores. with more than one hart
+// the store is also a compare and swap against the value lr.w loaded, to close the window between the claim and
+// the store, and the amos are host atomics. a misaligned word traps, as it could be neither atomic nor reserved,
+// and mmio is a plain read-modify-write. a writable page is readable too, so the amos are translated as stores
+static uint32_t riscv_amo32(RISCV *riscv, uint32_t op, uint32_t addr, uint32_t src)
+{
+    uint32_t *p, *slot, old, ok;
+    if (addr & 0x3) riscv_fault(riscv, op == 0x02 ? EXCP_LOAD_MISALIGNED : EXCP_STORE_MISALIGNED, addr);
+    p = (uint32_t*)riscv_host(riscv, addr, op == 0x02 ? RISCV_PMP_LOAD : RISCV_PMP_STORE);
+    if (!p) {
+        old = riscv_memr32(riscv, addr);
+        if (op == 0x03) {
+            if ((ok = riscv->mreserved == addr)) riscv_memw32(riscv, addr, src);
+            riscv->mreserved = RISCV_RESERVED_NONE;
+            return !ok;
+        }
+        if (op == 0x02) riscv->mreserved = addr, riscv->mreserved_val = old;
+        else riscv_memw32(riscv, addr, riscv_amo_op(op, old, src));
+        return old;
+    }
+    addr = (uint8_t*)p - riscv->mem; // the word is known by its ram offset from here on, as the reservations are
+    slot = &riscv->reserved[(addr >> 2) & (RISCV_RESERVED_SLOTS - 1)];
+    switch (op) {
+    case 0x02: // lr.w
+        __atomic_store_n(slot, addr, __ATOMIC_SEQ_CST);
+        old = __atomic_load_n(p, __ATOMIC_ACQUIRE);
+        riscv->mreserved = addr, riscv->mreserved_val = old;
+        return old;
+    case 0x03: // sc.w
+        if (riscv->mreserved != addr) return 1;
+        riscv->mreserved = RISCV_RESERVED_NONE;
+        old = addr;
+        if (!__atomic_compare_exchange_n(slot, &old, RISCV_RESERVED_NONE, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) return 1;
+        if (riscv->mach->nharts == 1) { *p = src; return 0; }
+        old = riscv->mreserved_val;
+        return !__atomic_compare_exchange_n(p, &old, src, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+    case 0x01: old = __atomic_exchange_n(p, src, __ATOMIC_SEQ_CST); break;
+    case 0x00: old = __atomic_fetch_add (p, src, __ATOMIC_SEQ_CST); break;
+    case 0x04: old = __atomic_fetch_xor (p, src, __ATOMIC_SEQ_CST); break;
+    case 0x0c: old = __atomic_fetch_and (p, src, __ATOMIC_SEQ_CST); break;
+    case 0x08: old = __atomic_fetch_or  (p, src, __ATOMIC_SEQ_CST); break;
+    default: // min and max
+        old = __atomic_load_n(p, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(p, &old, riscv_amo_op(op, old, src), 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+        break;
+    }
+    riscv_resv_kill(riscv, addr);
+    return old;
+}
+
+// rv32fd on the host fpu. single values are nan-boxed in f[], arithmetic results are canonical nans. the host
+// exception flags are sticky, they are only folded into fflags at the end of a slice or on fcsr access, and the
+// host rounding mode is switched only when an instruction asks for a different one. rmm has no host mode, it is
+// exact for conversions to integer and falls back to rne for arithmetic
+#define FP_BOX_S   0xFFFFFFFF00000000ull
+#define FP_NAN_S   0x7fc00000u
+#define FP_NAN_D   0x7ff8000000000000ull
+#define FP_RM_RMM  4
+#define fp_isnan_s(u)  (((u) & 0x7fffffffu) > 0x7f800000u)
+#define fp_issnan_s(u) (fp_isnan_s(u) && !((u) & 0x00400000u))
+#define fp_isnan_d(u)  (((u) & 0x7fffffffffffffffull) > 0x7ff0000000000000ull)
+#define fp_issnan_d(u) (fp_isnan_d(u) && !((u) & 0x0008000000000000ull))
+
+static inline float    fp_u2s(uint32_t u) { float    v; memcpy(&v, &u, sizeof(v)); return v; }
+static inline double   fp_u2d(uint64_t u) { double   v; memcpy(&v, &u, sizeof(v)); return v; }
+static inline uint32_t fp_s2u(float    v) { uint32_t u; memcpy(&u, &v, sizeof(u)); return u; }
+static inline uint64_t fp_d2u(double   v) { uint64_t u; memcpy(&u, &v, sizeof(u)); return u; }
+static inline uint32_t fp_rds(RISCV *riscv, int r) { return (riscv->f[r] >> 32) == 0xFFFFFFFF ? (uint32_t)riscv->f[r] : FP_NAN_S; }
+static inline void fp_wrs(RISCV *riscv, int r, float  v) { uint32_t u = fp_s2u(v); riscv->f[r] = FP_BOX_S | (fp_isnan_s(u) ? FP_NAN_S : u); }
+static inline void fp_wrd(RISCV *riscv, int r, double v) { uint64_t u = fp_d2u(v); riscv->f[r] = fp_isnan_d(u) ? FP_NAN_D : u; }
+
+static uint32_t riscv_fp_round(RISCV *riscv, uint32_t rm)
+{
+    static const int s_host_round[8] = { FE_TONEAREST, FE_TOWARDZERO, FE_DOWNWARD, FE_UPWARD, FE_TONEAREST, FE_TONEAREST, FE_TONEAREST, FE_TONEAREST };
+    rm = rm == 7 ? riscv->csr[RISCV_CSR_FRM] & 7 : rm;
+    if (rm != riscv->fround) { fesetround(s_host_round[rm]); riscv->fround = rm; }
+    return rm;
+}
+
+static void riscv_fp_flags(RISCV *riscv)
+{
+    int e = fetestexcept(FE_ALL_EXCEPT);
+    if (!e) return;
+    riscv->csr[RISCV_CSR_FFLAGS] |= ((e & FE_INVALID  ) ? (1 << 4) : 0) | ((e & FE_DIVBYZERO) ? (1 << 3) : 0)
+                                  | ((e & FE_OVERFLOW ) ? (1 << 2) : 0) | ((e & FE_UNDERFLOW) ? (1 << 1) : 0)
+                                  | ((e & FE_INEXACT  ) ? (1 << 0) : 0);
+    feclearexcept(FE_ALL_EXCEPT);
+}
+
+static uint32_t fp_cvt_w(double v, uint32_t rm, int nan, int unsign)
+{
+    double r = rm == FP_RM_RMM ? round(v) : rint(v);
+    if (rm == FP_RM_RMM && r != v) feraiseexcept(FE_INEXACT);
+    if (unsign) {
+        if (nan || r >= 4294967296.0) { feraiseexcept(FE_INVALID); return 0xFFFFFFFF; }
+        if (r < 0) { feraiseexcept(FE_INVALID); return 0; }
+        return (uint32_t)r;
+    }
+    if (nan || r >= 2147483648.0) { feraiseexcept(FE_INVALID); return 0x7FFFFFFF; }
+    if (r < -2147483648.0) { feraiseexcept(FE_INVALID); return 0x80000000; }
+    return (uint32_t)(int32_t)r;
+}
+
+static uint32_t fp_class(uint32_t sign, uint32_t expmax, uint32_t expzero, uint32_t mant, uint32_t quiet)
+{
+    if (expmax ) return mant ? (quiet ? 1 << 9 : 1 << 8) : (sign ? 1 << 0 : 1 << 7);
+    if (expzero) return mant ? (sign  ? 1 << 2 : 1 << 5) : (sign ? 1 << 3 : 1 << 4);
+    return sign ? 1 << 1 : 1 << 6;
+}
+
+static uint32_t fp_minmax_s(uint32_t a, uint32_t b, int max)
+{
+    if (fp_issnan_s(a) || fp_issnan_s(b)) feraiseexcept(FE_INVALID);
+    if (fp_isnan_s(a)) return fp_isnan_s(b) ? FP_NAN_S : b;
+    if (fp_isnan_s(b)) return a;
+    if (((a | b) & 0x7fffffffu) == 0) return max ? a & b : a | b; // -0 < +0
+    return (fp_u2s(a) < fp_u2s(b)) ^ max ? a : b;
+}
+
+static uint64_t fp_minmax_d(uint64_t a, uint64_t b, int max)
+{
+    if (fp_issnan_d(a) || fp_issnan_d(b)) feraiseexcept(FE_INVALID);
+    if (fp_isnan_d(a)) return fp_isnan_d(b) ? FP_NAN_D : b;
+    if (fp_isnan_d(b)) return a;
+    if (((a | b) & 0x7fffffffffffffffull) == 0) return max ? a & b : a | b;
+    return (fp_u2d(a) < fp_u2d(b)) ^ max ? a : b;
+}
+
+static uint32_t fp_compare(int anan, int bnan, int asnan, int bsnan, int lt, int eq, uint32_t funct3)
+{
+    switch (funct3) {
+    case 2: if (asnan || bsnan) feraiseexcept(FE_INVALID); return !anan && !bnan && eq; // feq
+    case 1: if (anan  || bnan ) { feraiseexcept(FE_INVALID); return 0; } return lt;       // flt
+    case 0: if (anan  || bnan ) { feraiseexcept(FE_INVALID); return 0; } return lt || eq; // fle
+    }
+    return 0;
+}
+
+static void riscv_execute_fp(RISCV *riscv, uint32_t instruction)
+{
+    const uint32_t inst_opcode = (instruction >> 0 ) & 0x7f;
+    const uint32_t inst_rd     = (instruction >> 7 ) & 0x1f;
+    const uint32_t inst_funct3 = (instruction >> 12) & 0x07;
+    const uint32_t inst_rs1    = (instruction >> 15) & 0x1f;
+    const uint32_t inst_rs2    = (instruction >> 20) & 0x1f;
+    const uint32_t inst_rs3    = (instruction >> 27) & 0x1f;
+    const uint32_t inst_funct7 = (instruction >> 25) & 0x7f;
+    const uint32_t inst_imm12i = (instruction >> 20);
+    const uint32_t inst_imm12s =((instruction >> 20) & (0x7f << 5)) | ((instruction >> 7) & 0x1f);
+    uint32_t maddr, rm, a = fp_rds(riscv, inst_rs1), b = fp_rds(riscv, inst_rs2), temp;
+    uint64_t da = riscv->f[inst_rs1], db = riscv->f[inst_rs2];
+    float    fa = fp_u2s(a), fb = fp_u2s(b), fc;
+    double   dc;
+
+    switch (inst_opcode) {
+    case 0x07: // flw, fld
+        maddr = riscv->x[inst_rs1] + signed_extend(inst_imm12i, 12);
+        if (inst_funct3 == 2) riscv->f[inst_rd] = FP_BOX_S | riscv_memr32(riscv, maddr);
+        if (inst_funct3 == 3) riscv->f[inst_rd] = riscv_memr32(riscv, maddr) | (uint64_t)riscv_memr32(riscv, maddr + 4) << 32;
+        break;
+    case 0x27: // fsw, fsd
+        maddr = riscv->x[inst_rs1] + signed_extend(inst_imm12s, 12);
+        if (inst_funct3 == 2) riscv_memw32(riscv, maddr, (uint32_t)riscv->f[inst_rs2]);
+        if (inst_funct3 == 3) {
+            riscv_memw32(riscv, maddr + 0, (uint32_t)(riscv->f[inst_rs2] >> 0 ));
+            riscv_memw32(riscv, maddr + 4, (uint32_t)(riscv->f[inst_rs2] >> 32));
+        }
+        break;
+    case 0x43: case 0x47: case 0x4b: case 0x4f: // fmadd, fmsub, fnmsub, fnmadd
+        riscv_fp_round(riscv, inst_funct3);
+        if ((inst_funct7 & 3) == 0) {
+            fc = fp_u2s(fp_rds(riscv, inst_rs3));
+            fp_wrs(riscv, inst_rd, fmaf(inst_opcode & 0x8 ? -fa : fa, fb, inst_opcode & 0x4 ? -fc : fc));
+        } else {
+            dc = fp_u2d(riscv->f[inst_rs3]);
+            fp_wrd(riscv, inst_rd, fma (inst_opcode & 0x8 ? -fp_u2d(da) : fp_u2d(da), fp_u2d(db), inst_opcode & 0x4 ? -dc : dc));
+        }
+        break;
+    case 0x53:
+        switch (inst_funct7) {
+        case 0x00: riscv_fp_round(riscv, inst_funct3); fp_wrs(riscv, inst_rd, fa + fb); break; // fadd.s
+        case 0x01: riscv_fp_round(riscv, inst_funct3); fp_wrd(riscv, inst_rd, fp_u2d(da) + fp_u2d(db)); break; // fadd.d
+        case 0x04: riscv_fp_round(riscv, inst_funct3); fp_wrs(riscv, inst_rd, fa - fb); break; // fsub.s
+        case 0x05: riscv_fp_round(riscv, inst_funct3); fp_wrd(riscv, inst_rd, fp_u2d(da) - fp_u2d(db)); break; // fsub.d
+        case 0x08: riscv_fp_round(riscv, inst_funct3); fp_wrs(riscv, inst_rd, fa * fb); break; // fmul.s
+        case 0x09: riscv_fp_round(riscv, inst_funct3); fp_wrd(riscv, inst_rd, fp_u2d(da) * fp_u2d(db)); break; // fmul.d
+        case 0x0C: riscv_fp_round(riscv, inst_funct3); fp_wrs(riscv, inst_rd, fa / fb); break; // fdiv.s
+        case 0x0D: riscv_fp_round(riscv, inst_funct3); fp_wrd(riscv, inst_rd, fp_u2d(da) / fp_u2d(db)); break; // fdiv.d
+        case 0x2C: riscv_fp_round(riscv, inst_funct3); fp_wrs(riscv, inst_rd, sqrtf(fa)); break; // fsqrt.s
+        case 0x2D: riscv_fp_round(riscv, inst_funct3); fp_wrd(riscv, inst_rd, sqrt (fp_u2d(da))); break; // fsqrt.d
+        case 0x10: // fsgnj.s, fsgnjn.s, fsgnjx.s
+            temp = inst_funct3 == 0 ? b : inst_funct3 == 1 ? ~b : a ^ b;
+            riscv->f[inst_rd] = FP_BOX_S | (a & 0x7fffffffu) | (temp & 0x80000000u);
+            break;
+        case 0x11: // fsgnj.d, fsgnjn.d, fsgnjx.d
+            db = inst_funct3 == 0 ? db : inst_funct3 == 1 ? ~db : da ^ db;
+            riscv->f[inst_rd] = (da & 0x7fffffffffffffffull) | (db & 0x8000000000000000ull);
+            break;
+        case 0x14: riscv->f[inst_rd] = FP_BOX_S | fp_minmax_s(a, b, inst_funct3 & 1); break; // fmin.s, fmax.s
+        case 0x15: riscv->f[inst_rd] = fp_minmax_d(da, db, inst_funct3 & 1); break; // fmin.d, fmax.d
+        case 0x20: riscv_fp_round(riscv, inst_funct3); fp_wrs(riscv, inst_rd, (float )fp_u2d(da)); break; // fcvt.s.d
+        case 0x21: fp_wrd(riscv, inst_rd, (double)fa); break; // fcvt.d.s
+        case 0x50: // feq.s, flt.s, fle.s
+            riscv->x[inst_rd] = fp_compare(fp_isnan_s(a), fp_isnan_s(b), fp_issnan_s(a), fp_issnan_s(b),
+                !fp_isnan_s(a) && !fp_isnan_s(b) && fa < fb, !fp_isnan_s(a) && !fp_isnan_s(b) && fa == fb, inst_funct3);
+            break;
+        case 0x51: // feq.d, flt.d, fle.d
+            riscv->x[inst_rd] = fp_compare(fp_isnan_d(da), fp_isnan_d(db), fp_issnan_d(da), fp_issnan_d(db),
+                !fp_isnan_d(da) && !fp_isnan_d(db) && fp_u2d(da) < fp_u2d(db), !fp_isnan_d(da) && !fp_isnan_d(db) && fp_u2d(da) == fp_u2d(db), inst_funct3);
+            break;
+        case 0x60: // fcvt.w.s, fcvt.wu.s
+            rm = riscv_fp_round(riscv, inst_funct3);
+            riscv->x[inst_rd] = fp_cvt_w(fp_isnan_s(a) ? 0 : fa, rm, fp_isnan_s(a), inst_rs2 & 1);
+            break;
+        case 0x61: // fcvt.w.d, fcvt.wu.d
+            rm = riscv_fp_round(riscv, inst_funct3);
+            riscv->x[inst_rd] = fp_cvt_w(fp_isnan_d(da) ? 0 : fp_u2d(da), rm, fp_isnan_d(da), inst_rs2 & 1);
+            break;
+        case 0x68: // fcvt.s.w, fcvt.s.wu
+            riscv_fp_round(riscv, inst_funct3);
+            fp_wrs(riscv, inst_rd, inst_rs2 & 1 ? (float)riscv->x[inst_rs1] : (float)(int32_t)riscv->x[inst_rs1]);
+            break;
+        case 0x69: fp_wrd(riscv, inst_rd, inst_rs2 & 1 ? (double)riscv->x[inst_rs1] : (double)(int32_t)riscv->x[inst_rs1]); break; // fcvt.d.w, fcvt.d.wu
+        case 0x70: // fmv.x.w, fclass.s
+            if (inst_funct3 == 0) riscv->x[inst_rd] = (uint32_t)riscv->f[inst_rs1];
+            if (inst_funct3 == 1) riscv->x[inst_rd] = fp_class(a >> 31, (a & 0x7f800000u) == 0x7f800000u, !(a & 0x7f800000u), a & 0x7fffffu, a & 0x400000u);
+            break;
+        case 0x71: // fclass.d
+            riscv->x[inst_rd] = fp_class(da >> 63, (da & 0x7ff0000000000000ull) == 0x7ff0000000000000ull, !(da & 0x7ff0000000000000ull),
+                                         !!(da & 0xfffffffffffffull), !!(da & 0x8000000000000ull));
+            break;
+        case 0x78: riscv->f[inst_rd] = FP_BOX_S | riscv->x[inst_rs1]; break; // fmv.w.x
+        }
+        break;
+    }
+}
+
+static uint32_t riscv_execute_rv16(RISCV *riscv, uint16_t instruction)
 {
     const uint16_t inst_opcode = (instruction >> 0) & 0x3;
     const uint16_t inst_rd     = (instruction >> 7) & 0x1f;
@@ -511,7 +1614,7 @@ static void riscv_execute_rv16(RISCV *riscv, uint16_t instruction)
             riscv->f[8 + inst_rds]|= (uint64_t)riscv_memr32(riscv, riscv->x[8 + inst_rs1s] + inst_imm8 + 4) << 32;
             break;
         case 2: riscv->x[8 + inst_rds] = riscv_memr32(riscv, riscv->x[8 + inst_rs1s] + inst_imm7); break; // c.lw
-        case 3: riscv->f[8 + inst_rds] = riscv_memr32(riscv, riscv->x[8 + inst_rs1s] + inst_imm7); break; // c.flw
+        case 3: riscv->f[8 + inst_rds] = FP_BOX_S | riscv_memr32(riscv, riscv->x[8 + inst_rs1s] + inst_imm7); break; // c.flw
         case 5: // c.fsd
             riscv_memw32(riscv, riscv->x[8 + inst_rs1s] + inst_imm8 + 0, (uint32_t)(riscv->f[8 + inst_rs2s] >> 0 ));
             riscv_memw32(riscv, riscv->x[8 + inst_rs1s] + inst_imm8 + 4, (uint32_t)(riscv->f[8 + inst_rs2s] >> 32));
@@ -576,7 +1679,7 @@ static void riscv_execute_rv16(RISCV *riscv, uint16_t instruction)
         case 3: // c.flwsp
             temp = ((instruction >> 2) & (0x7 << 2)) | ((instruction >> 7) & (1 << 5)) | ((instruction << 4) & (0x3 << 6));
             if (inst_funct3 == 2) riscv->x[inst_rd] = riscv_memr32(riscv, riscv->x[2] + temp); // c.lwsp
-            else                  riscv->f[inst_rd] = riscv_memr32(riscv, riscv->x[2] + temp); // c.flwsp
+            else                  riscv->f[inst_rd] = FP_BOX_S | riscv_memr32(riscv, riscv->x[2] + temp); // c.flwsp
             break;
         case 4:
             if ((instruction & (1 << 12)) == 0) {
@@ -611,9 +1714,619 @@ static void riscv_execute_rv16(RISCV *riscv, uint16_t instruction)
         break;
     }
     riscv->pc += bflag ? 0 : 2;
+    return bflag;
+}
+
+// zba/zbb/zbs, the op and op-imm encodings outside of rv32im. the gcc builtins become single host instructions
+// where the host has them
+#define ZB(funct7, funct3) (((funct7) << 3) | (funct3))
+static void riscv_execute_zb(RISCV *riscv, uint32_t instruction)
+{
+    const uint32_t inst_opcode = (instruction >> 0 ) & 0x7f;
+    const uint32_t inst_rd     = (instruction >> 7 ) & 0x1f;
+    const uint32_t inst_funct3 = (instruction >> 12) & 0x07;
+    const uint32_t inst_rs1    = (instruction >> 15) & 0x1f;
+    const uint32_t inst_rs2    = (instruction >> 20) & 0x1f; // shamt or unary op selector for op-imm
+    const uint32_t inst_funct7 = (instruction >> 25) & 0x7f;
+    uint32_t a = riscv->x[inst_rs1], b = inst_opcode == 0x13 ? inst_rs2 : riscv->x[inst_rs2], m;
+
+    if (inst_opcode == 0x13) {
+        switch (ZB(inst_funct7, inst_funct3)) {
+        case ZB(0x30, 1):
+            switch (inst_rs2) {
+            case 0: riscv->x[inst_rd] = a ? __builtin_clz(a) : 32; break; // clz
+            case 1: riscv->x[inst_rd] = a ? __builtin_ctz(a) : 32; break; // ctz
+            case 2: riscv->x[inst_rd] = __builtin_popcount(a);     break; // cpop
+            case 4: riscv->x[inst_rd] = (int8_t )a; break; // sext.b
+            case 5: riscv->x[inst_rd] = (int16_t)a; break; // sext.h
+            }
+            break;
+        case ZB(0x14, 1): riscv->x[inst_rd] = a |  (1u << b); break; // bseti
+        case ZB(0x24, 1): riscv->x[inst_rd] = a & ~(1u << b); break; // bclri
+        case ZB(0x34, 1): riscv->x[inst_rd] = a ^  (1u << b); break; // binvi
+        case ZB(0x30, 5): riscv->x[inst_rd] = (a >> b) | (a << ((32 - b) & 0x1f)); break; // rori
+        case ZB(0x24, 5): riscv->x[inst_rd] = (a >> b) & 1; break; // bexti
+        case ZB(0x14, 5): // orc.b
+            m = (((a & 0x7f7f7f7f) + 0x7f7f7f7f) | a) & 0x80808080;
+            if (inst_rs2 == 0x07) riscv->x[inst_rd] = (m >> 7) * 0xff;
+            break;
+        case ZB(0x34, 5): if (inst_rs2 == 0x18) riscv->x[inst_rd] = __builtin_bswap32(a); break; // rev8
+        }
+        return;
+    }
+    switch (ZB(inst_funct7, inst_funct3)) {
+    case ZB(0x10, 2): riscv->x[inst_rd] = (a << 1) + b; break; // sh1add
+    case ZB(0x10, 4): riscv->x[inst_rd] = (a << 2) + b; break; // sh2add
+    case ZB(0x10, 6): riscv->x[inst_rd] = (a << 3) + b; break; // sh3add
+    case ZB(0x20, 7): riscv->x[inst_rd] = a & ~b; break; // andn
+    case ZB(0x20, 6): riscv->x[inst_rd] = a | ~b; break; // orn
+    case ZB(0x20, 4): riscv->x[inst_rd] = ~(a ^ b); break; // xnor
+    case ZB(0x05, 4): riscv->x[inst_rd] = (int32_t)a < (int32_t)b ? a : b; break; // min
+    case ZB(0x05, 5): riscv->x[inst_rd] = a < b ? a : b; break; // minu
+    case ZB(0x05, 6): riscv->x[inst_rd] = (int32_t)a > (int32_t)b ? a : b; break; // max
+    case ZB(0x05, 7): riscv->x[inst_rd] = a > b ? a : b; break; // maxu
+    case ZB(0x30, 1): riscv->x[inst_rd] = (a << (b & 0x1f)) | (a >> ((32 - b) & 0x1f)); break; // rol
+    case ZB(0x30, 5): riscv->x[inst_rd] = (a >> (b & 0x1f)) | (a << ((32 - b) & 0x1f)); break; // ror
+    case ZB(0x04, 4): if (inst_rs2 == 0) riscv->x[inst_rd] = a & 0xffff; break; // zext.h
+    case ZB(0x24, 1): riscv->x[inst_rd] = a & ~(1u << (b & 0x1f)); break; // bclr
+    case ZB(0x24, 5): riscv->x[inst_rd] = (a >> (b & 0x1f)) & 1; break; // bext
+    case ZB(0x14, 1): riscv->x[inst_rd] = a |  (1u << (b & 0x1f)); break; // bset
+    case ZB(0x34, 1): riscv->x[inst_rd] = a ^  (1u << (b & 0x1f)); break; // binv
+    }
+}
+
+// rvv 1.0 subset in the zve32f profile, vlen 256, sew 8/16/32, lmul 1/8 to 8: vset{i}vl{i}, unit-stride, strided,
+// indexed, whole register and mask loads/stores, integer, saturating, mask and float arithmetic, reductions, slides
+// and moves. each instruction is a plain loop over the elements, the unmasked integer and float arithmetic goes
+// through rvv_arith which gcc vectorizes for the host simd, unmasked unit-stride accesses to ram are a memcpy.
+// vstart is always 0, tail and masked-off elements are left undisturbed,
+// segment accesses, vxrm rounding ops and widening/narrowing ops are not there and ignored like other unknown opcodes
+#define RVV_EACH(body) for (i = 0; i < vl; i++) if (vm || rvv_mask(riscv, i)) { body; }
+#define RVV_SEW(M, expr) do { \
+    switch (sew) { \
+    case 8 : M(uint8_t , int8_t , expr); break; \
+    case 16: M(uint16_t, int16_t, expr); break; \
+    case 32: M(uint32_t, int32_t, expr); break; \
+    } } while (0)
+#define RVV_OP(TU, TS, expr)  RVV_EACH(typedef TU U; typedef TS S; (void)sizeof(S); U a = ((U*)vs2)[i]; U b = vv ? ((U*)vs1)[i] : (U)sx; U c = ((U*)vd)[i]; \
+                                       (void)a; (void)b; (void)c; ((U*)vd)[i] = (U)(expr))
+#define RVV_CMP(TU, TS, expr) RVV_EACH(typedef TU U; typedef TS S; (void)sizeof(S); U a = ((U*)vs2)[i]; U b = vv ? ((U*)vs1)[i] : (U)sx; \
+                                       vd[i >> 3] = (vd[i >> 3] & ~(1 << (i & 7))) | ((expr) << (i & 7)))
+#define RVV_RED(TU, TS, expr) do { typedef TU U; typedef TS S; (void)sizeof(S); U b = ((U*)vs1)[0]; RVV_EACH(U a = ((U*)vs2)[i]; b = (U)(expr)); if (vl) ((U*)vd)[0] = b; } while (0)
+#define RVV_FOP(expr)  RVV_EACH(float a = ((float*)vs2)[i]; float b = vv ? ((float*)vs1)[i] : fsx; float c = ((float*)vd)[i]; float r = (expr); (void)b; (void)c; \
+                                ((float*)vd)[i] = r != r ? fp_u2s(FP_NAN_S) : r)
+#define RVV_FCMP(expr) RVV_EACH(float a = ((float*)vs2)[i]; float b = vv ? ((float*)vs1)[i] : fsx; vd[i >> 3] = (vd[i >> 3] & ~(1 << (i & 7))) | ((expr) << (i & 7)))
+#define RVV_BITS(U)    (sizeof(U) * 8)
+#define RVV_SMIN(U)    (-((int64_t)1 << (RVV_BITS(U) - 1)))
+#define RVV_SMAX(U)    (((int64_t)1 << (RVV_BITS(U) - 1)) - 1)
+
+static inline int rvv_mask(RISCV *riscv, uint32_t i) { return (riscv->v[0][i >> 3] >> (i & 7)) & 1; }
+
+static inline int64_t rvv_sat(RISCV *riscv, int64_t r, int64_t lo, int64_t hi)
+{
+    if (r < lo) { riscv->csr[RISCV_CSR_VXSAT] = 1; return lo; }
+    if (r > hi) { riscv->csr[RISCV_CSR_VXSAT] = 1; return hi; }
+    return r;
+}
+
+#define RVV_VEC(T, s, expr) do { T *d = (T*)vd; const T *x = (const T*)vs2, *y = (const T*)vs1; T bs = (T)(s); \
+    if (vv) for (i = 0; i < vl; i++) { T a = x[i], b = y[i]; d[i] = (T)(expr); } \
+    else    for (i = 0; i < vl; i++) { T a = x[i], b = bs  ; d[i] = (T)(expr); } \
+    } while (0)
+#define RVV_VEC_SEW(T, expr) do { \
+    switch (sew) { \
+    case 8 : RVV_VEC(T##8_t , sx, expr); break; \
+    case 16: RVV_VEC(T##16_t, sx, expr); break; \
+    case 32: RVV_VEC(T##32_t, sx, expr); break; \
+    } } while (0)
+
+static inline float rvv_fnan(float r) { return r != r ? fp_u2s(FP_NAN_S) : r; }
+
+// unmasked vv/vx/vi integer and vv/vf float arithmetic, kept out of riscv_execute_rvv so that gcc sees small loops
+// without the mask test and the vv select and vectorizes them. returns 0 for the instructions it doesn't do
+static __attribute__((noinline)) int rvv_arith(uint8_t *vd, uint8_t *vs2, uint8_t *vs1, uint32_t funct3, uint32_t funct6, uint32_t sew, uint32_t vl, uint32_t sx, float fsx)
+{
+    uint32_t vv = funct3 == 0 || funct3 == 1 || funct3 == 2, i;
+    switch (funct3) {
+    case 0: case 3: case 4: // opivv, opivi, opivx
+        switch (funct6) {
+        case 0x00: RVV_VEC_SEW(uint, a + b); return 1; // vadd
+        case 0x02: RVV_VEC_SEW(uint, a - b); return 1; // vsub
+        case 0x03: RVV_VEC_SEW(uint, b - a); return 1; // vrsub
+        case 0x04: RVV_VEC_SEW(uint, a < b ? a : b); return 1; // vminu
+        case 0x05: RVV_VEC_SEW(int , a < b ? a : b); return 1; // vmin
+        case 0x06: RVV_VEC_SEW(uint, a > b ? a : b); return 1; // vmaxu
+        case 0x07: RVV_VEC_SEW(int , a > b ? a : b); return 1; // vmax
+        case 0x09: RVV_VEC_SEW(uint, a & b); return 1; // vand
+        case 0x0A: RVV_VEC_SEW(uint, a | b); return 1; // vor
+        case 0x0B: RVV_VEC_SEW(uint, a ^ b); return 1; // vxor
+        }
+        break;
+    case 2: case 6: // opmvv, opmvx
+        switch (funct6) {
+        case 0x25: RVV_VEC_SEW(uint, (uint32_t)a * b); return 1; // vmul
+        }
+        break;
+    case 1: case 5: // opfvv, opfvf
+        if (sew != 32) break;
+        switch (funct6) {
+        case 0x00: RVV_VEC(float, fsx, rvv_fnan(a + b)); return 1; // vfadd
+        case 0x02: RVV_VEC(float, fsx, rvv_fnan(a - b)); return 1; // vfsub
+        case 0x20: RVV_VEC(float, fsx, rvv_fnan(a / b)); return 1; // vfdiv
+        case 0x21: if (vv) break; RVV_VEC(float, fsx, rvv_fnan(b / a)); return 1; // vfrdiv
+        case 0x24: RVV_VEC(float, fsx, rvv_fnan(a * b)); return 1; // vfmul
+        case 0x27: if (vv) break; RVV_VEC(float, fsx, rvv_fnan(b - a)); return 1; // vfrsub
+        }
+        break;
+    }
+    return 0;
+}
+
+static uint32_t rvv_vlmax(uint32_t vtype)
+{
+    uint32_t sew = (vtype >> 3) & 7, lmul = vtype & 7;
+    if ((vtype >> 8) || sew > 2 || lmul == 4) return 0;
+    if (lmul & 4) return (32 >> (8 - lmul)) < (8u << sew) ? 0 : (RISCV_VLEN >> (3 + sew)) >> (8 - lmul);
+    return (RISCV_VLEN >> (3 + sew)) << lmul;
+}
+
+static int rvv_fits(uint32_t reg, uint32_t bytes) { return reg * RISCV_VLENB + bytes <= 32 * RISCV_VLENB; }
+
+// host pointer for a range in a ram page the tlb of the access type has, NULL if it isn't there or leaves the page
+static uint8_t* rvv_memptr(RISCV *riscv, uint32_t addr, uint32_t len, uint32_t type)
+{
+    TLBENTRY *e = riscv_tlb(riscv, type, addr);
+    if (e->vpn != addr >> 12 || (addr & 0xFFF) + len > 0x1000) return NULL;
+    return (uint8_t*)(e->addend + addr);
+}
+
+static void rvv_memrw(RISCV *riscv, uint32_t addr, uint8_t *data, uint32_t eew, int store)
+{
+    switch (eew) {
+    case 1: if (store) riscv_memw8 (riscv, addr, *data); else *data = riscv_memr8 (riscv, addr); break;
+    case 2: if (store) riscv_memw16(riscv, addr, *(uint16_t*)data); else *(uint16_t*)data = riscv_memr16(riscv, addr); break;
+    case 4: if (store) riscv_memw32(riscv, addr, *(uint32_t*)data); else *(uint32_t*)data = riscv_memr32(riscv, addr); break;
+    }
+}
+
+static void riscv_execute_vmem(RISCV *riscv, uint32_t instruction, uint32_t vl, uint32_t sew)
+{
+    const uint32_t inst_rd     = (instruction >> 7 ) & 0x1f; // vd or vs3
+    const uint32_t inst_funct3 = (instruction >> 12) & 0x07;
+    const uint32_t inst_rs1    = (instruction >> 15) & 0x1f;
+    const uint32_t inst_rs2    = (instruction >> 20) & 0x1f; // lumop, stride register or index vector
+    const uint32_t mop         = (instruction >> 26) & 0x3;
+    const uint32_t nf          = (instruction >> 29) & 0x7;
+    const int      store       = (instruction & 0x7f) == 0x27;
+    uint32_t eew = inst_funct3 == 0 ? 1 : inst_funct3 == 5 ? 2 : inst_funct3 == 6 ? 4 : 0, base = riscv->x[inst_rs1], addr, i, vm = (instruction >> 25) & 0x1;
+    uint8_t *vd = riscv->v[inst_rd], *p;
+
+    if (!eew) return;
+    if (mop == 0 && inst_rs2 == 0x08) { // whole register
+        if (!(nf == 0 || nf == 1 || nf == 3 || nf == 7)) return;
+        vl = (nf + 1) * RISCV_VLENB / eew, vm = 1;
+    } else if (mop == 0 && inst_rs2 == 0x0B) { // vlm.v, vsm.v
+        vl = (vl + 7) / 8, eew = 1, vm = 1;
+    } else if (nf) {
+        return;
+    }
+    if (!rvv_fits(inst_rd, vl * (mop & 1 ? sew / 8 : eew))) return;
+    if (mop == 0) { // unit-stride, fault-only-first never faults here
+        if (vm && (p = rvv_memptr(riscv, base, vl * eew, store ? RISCV_PMP_STORE : RISCV_PMP_LOAD))) {
+            if (store) memcpy(p, vd, vl * eew);
+            else       memcpy(vd, p, vl * eew);
+            for (addr = (p - riscv->mem) & ~0x3; store && addr < (uint32_t)(p - riscv->mem) + vl * eew; addr += 4) riscv_resv_kill(riscv, addr);
+            return;
+        }
+        RVV_EACH(rvv_memrw(riscv, base + i * eew, vd + i * eew, eew, store));
+    } else if (mop == 2) { // strided
+        RVV_EACH(rvv_memrw(riscv, base + i * riscv->x[inst_rs2], vd + i * eew, eew, store));
+    } else { // indexed, the index eew comes from the instruction, data elements are sew
+        if (!rvv_fits(inst_rs2, vl * eew)) return;
+        RVV_EACH(
+            addr = base + (eew == 1 ? riscv->v[inst_rs2][i] : eew == 2 ? ((uint16_t*)riscv->v[inst_rs2])[i] : ((uint32_t*)riscv->v[inst_rs2])[i]);
+            rvv_memrw(riscv, addr, vd + i * sew / 8, sew / 8, store));
+    }
+}
+
+static void riscv_execute_rvv(RISCV *riscv, uint32_t instruction)
+{
+    const uint32_t inst_opcode = (instruction >> 0 ) & 0x7f;
+    const uint32_t inst_rd     = (instruction >> 7 ) & 0x1f;
+    const uint32_t inst_funct3 = (instruction >> 12) & 0x07;
+    const uint32_t inst_rs1    = (instruction >> 15) & 0x1f; // vs1, rs1, fs1 or simm5
+    const uint32_t inst_rs2    = (instruction >> 20) & 0x1f;
+    const uint32_t inst_funct6 = (instruction >> 26) & 0x3f;
+    uint32_t vtype = riscv->csr[RISCV_CSR_VTYPE], vl = riscv->csr[RISCV_CSR_VL], vm = (instruction >> 25) & 1;
+    uint32_t sew   = 8u << ((vtype >> 3) & 7), vlmax, vv, sx = 0, m, i, avl, gbytes;
+    uint8_t *vd = riscv->v[inst_rd], *vs1 = riscv->v[inst_rs1], *vs2 = riscv->v[inst_rs2];
+    float    fsx = 0;
+
+    if (inst_opcode == 0x57 && inst_funct3 == 7) { // vsetvli, vsetivli, vsetvl
+        if      ((instruction >> 30) == 3) vtype = (instruction >> 20) & 0x3ff, avl = inst_rs1;
+        else if ((instruction >> 31) == 0) vtype = (instruction >> 20) & 0x7ff, avl = riscv->x[inst_rs1];
+        else                               vtype = riscv->x[inst_rs2]         , avl = riscv->x[inst_rs1];
+        if ((instruction >> 30) != 3 && inst_rs1 == 0) avl = inst_rd ? 0xFFFFFFFF : vl;
+        if (!(vlmax = rvv_vlmax(vtype))) vtype = 1u << 31, vl = 0;
+        else vl = avl < vlmax ? avl : vlmax;
+        riscv->csr[RISCV_CSR_VTYPE] = vtype;
+        riscv->csr[RISCV_CSR_VL   ] = vl;
+        riscv->x[inst_rd] = vl;
+        return;
+    }
+    if (vtype >> 31) return; // vill
+    if (inst_opcode != 0x57) { riscv_execute_vmem(riscv, instruction, vl, sew); return; }
+
+    vlmax  = rvv_vlmax(vtype);
+    gbytes = vlmax * sew / 8;
+    vv     = inst_funct3 == 0 || inst_funct3 == 1 || inst_funct3 == 2;
+    if (!rvv_fits(inst_rs2, gbytes) || (vv && !rvv_fits(inst_rs1, gbytes))) return;
+    if (!rvv_fits(inst_rd, (inst_funct6 & 0x38) == 0x18 ? (vl + 7) / 8 : gbytes)) return;
+    switch (inst_funct3) {
+    case 3: sx = signed_extend(inst_rs1, 5); break;
+    case 4: case 6: sx = riscv->x[inst_rs1]; break;
+    case 5: sx = fp_rds(riscv, inst_rs1), fsx = fp_u2s(sx); break;
+    }
+    riscv->csr[RISCV_CSR_VSTART] = 0;
+    if (inst_funct3 == 1 || inst_funct3 == 5) riscv_fp_round(riscv, 7);
+    if (vm && rvv_arith(vd, vs2, vs1, inst_funct3, inst_funct6, sew, vl, sx, fsx)) return;
+
+    switch (inst_funct3) {
+    case 0: case 3: case 4: // opivv, opivi, opivx
+        switch (inst_funct6) {
+        case 0x00: RVV_SEW(RVV_OP, a + b); break; // vadd
+        case 0x02: RVV_SEW(RVV_OP, a - b); break; // vsub
+        case 0x03: RVV_SEW(RVV_OP, b - a); break; // vrsub
+        case 0x04: RVV_SEW(RVV_OP, a < b ? a : b); break; // vminu
+        case 0x05: RVV_SEW(RVV_OP, (S)a < (S)b ? a : b); break; // vmin
+        case 0x06: RVV_SEW(RVV_OP, a > b ? a : b); break; // vmaxu
+        case 0x07: RVV_SEW(RVV_OP, (S)a > (S)b ? a : b); break; // vmax
+        case 0x09: RVV_SEW(RVV_OP, a & b); break; // vand
+        case 0x0A: RVV_SEW(RVV_OP, a | b); break; // vor
+        case 0x0B: RVV_SEW(RVV_OP, a ^ b); break; // vxor
+        case 0x0E: // vslideup
+            if (inst_funct3 == 3) sx = inst_rs1;
+            if (inst_funct3 != 0 && inst_rd != inst_rs2) RVV_SEW(RVV_OP, i >= sx ? ((U*)vs2)[i - sx] : c);
+            break;
+        case 0x0F: // vslidedown
+            if (inst_funct3 == 3) sx = inst_rs1;
+            if (inst_funct3 != 0) RVV_SEW(RVV_OP, (uint64_t)i + sx < vlmax ? ((U*)vs2)[i + sx] : 0);
+            break;
+        case 0x17: m = vm, vm = 1; RVV_SEW(RVV_OP, m || rvv_mask(riscv, i) ? b : a); break; // vmerge, vmv.v
+        case 0x18: RVV_SEW(RVV_CMP, a == b); break; // vmseq
+        case 0x19: RVV_SEW(RVV_CMP, a != b); break; // vmsne
+        case 0x1A: RVV_SEW(RVV_CMP, a <  b); break; // vmsltu
+        case 0x1B: RVV_SEW(RVV_CMP, (S)a <  (S)b); break; // vmslt
+        case 0x1C: RVV_SEW(RVV_CMP, a <= b); break; // vmsleu
+        case 0x1D: RVV_SEW(RVV_CMP, (S)a <= (S)b); break; // vmsle
+        case 0x1E: RVV_SEW(RVV_CMP, a >  b); break; // vmsgtu
+        case 0x1F: RVV_SEW(RVV_CMP, (S)a >  (S)b); break; // vmsgt
+        case 0x20: RVV_SEW(RVV_OP, rvv_sat(riscv, (int64_t)a + b, 0, (U)~0)); break; // vsaddu
+        case 0x21: RVV_SEW(RVV_OP, rvv_sat(riscv, (int64_t)(S)a + (S)b, RVV_SMIN(U), RVV_SMAX(U))); break; // vsadd
+        case 0x22: RVV_SEW(RVV_OP, rvv_sat(riscv, (int64_t)a - b, 0, (U)~0)); break; // vssubu
+        case 0x23: RVV_SEW(RVV_OP, rvv_sat(riscv, (int64_t)(S)a - (S)b, RVV_SMIN(U), RVV_SMAX(U))); break; // vssub
+        case 0x25: RVV_SEW(RVV_OP, a << (b & (RVV_BITS(U) - 1))); break; // vsll
+        case 0x27: // vmv<nr>r.v
+            m = inst_rs1 + 1;
+            if (inst_funct3 == 3 && (m == 1 || m == 2 || m == 4 || m == 8) && rvv_fits(inst_rd, m * RISCV_VLENB) && rvv_fits(inst_rs2, m * RISCV_VLENB)) {
+                memmove(vd, vs2, m * RISCV_VLENB);
+            }
+            break;
+        case 0x28: RVV_SEW(RVV_OP, a >> (b & (RVV_BITS(U) - 1))); break; // vsrl
+        case 0x29: RVV_SEW(RVV_OP, (S)a >> (b & (RVV_BITS(U) - 1))); break; // vsra
+        }
+        break;
+    case 2: case 6: // opmvv, opmvx
+        switch (inst_funct6) {
+        case 0x00: if (inst_funct3 == 2) RVV_SEW(RVV_RED, a + b); break; // vredsum
+        case 0x01: if (inst_funct3 == 2) RVV_SEW(RVV_RED, a & b); break; // vredand
+        case 0x02: if (inst_funct3 == 2) RVV_SEW(RVV_RED, a | b); break; // vredor
+        case 0x03: if (inst_funct3 == 2) RVV_SEW(RVV_RED, a ^ b); break; // vredxor
+        case 0x04: if (inst_funct3 == 2) RVV_SEW(RVV_RED, a < b ? a : b); break; // vredminu
+        case 0x05: if (inst_funct3 == 2) RVV_SEW(RVV_RED, (S)a < (S)b ? a : b); break; // vredmin
+        case 0x06: if (inst_funct3 == 2) RVV_SEW(RVV_RED, a > b ? a : b); break; // vredmaxu
+        case 0x07: if (inst_funct3 == 2) RVV_SEW(RVV_RED, (S)a > (S)b ? a : b); break; // vredmax
+        case 0x0E: if (inst_funct3 == 6 && inst_rd != inst_rs2) RVV_SEW(RVV_OP, i ? ((U*)vs2)[i - 1] : b); break; // vslide1up
+        case 0x0F: if (inst_funct3 == 6) RVV_SEW(RVV_OP, i + 1 < vl ? ((U*)vs2)[i + 1] : b); break; // vslide1down
+        case 0x10:
+            if (inst_funct3 == 2 && inst_rs1 == 0x00) riscv->x[inst_rd] = sew == 8 ? (int8_t)vs2[0] : sew == 16 ? (int16_t)((uint16_t*)vs2)[0] : ((uint32_t*)vs2)[0]; // vmv.x.s
+            if (inst_funct3 == 2 && inst_rs1 == 0x10) { for (m = 0, i = 0; i < vl; i++) m += (vm || rvv_mask(riscv, i)) && ((vs2[i >> 3] >> (i & 7)) & 1); riscv->x[inst_rd] = m; } // vcpop.m
+            if (inst_funct3 == 2 && inst_rs1 == 0x11) { // vfirst.m
+                for (m = 0xFFFFFFFF, i = 0; i < vl && m == 0xFFFFFFFF; i++) if ((vm || rvv_mask(riscv, i)) && ((vs2[i >> 3] >> (i & 7)) & 1)) m = i;
+                riscv->x[inst_rd] = m;
+            }
+            if (inst_funct3 == 6 && inst_rs2 == 0x00 && vl) memcpy(vd, &sx, sew / 8); // vmv.s.x
+            break;
+        case 0x14: if (inst_funct3 == 2 && inst_rs1 == 0x11) RVV_SEW(RVV_OP, i); break; // vid.v
+        case 0x18: case 0x19: case 0x1A: case 0x1B: case 0x1C: case 0x1D: case 0x1E: case 0x1F: // vmandn, vmand, vmor, vmxor, vmorn, vmnand, vmnor, vmxnor
+            if (inst_funct3 != 2) break;
+            for (i = 0; i < vl; i++) {
+                uint32_t a = (vs2[i >> 3] >> (i & 7)) & 1, b = (vs1[i >> 3] >> (i & 7)) & 1, r = 0;
+                switch (inst_funct6) {
+                case 0x18: r = a & !b; break;
+                case 0x19: r = a &  b; break;
+                case 0x1A: r = a |  b; break;
+                case 0x1B: r = a ^  b; break;
+                case 0x1C: r = a | !b; break;
+                case 0x1D: r = !(a & b); break;
+                case 0x1E: r = !(a | b); break;
+                case 0x1F: r = !(a ^ b); break;
+                }
+                vd[i >> 3] = (vd[i >> 3] & ~(1 << (i & 7))) | (r << (i & 7));
+            }
+            break;
+        case 0x20: RVV_SEW(RVV_OP, b ? a / b : (U)~0); break; // vdivu
+        case 0x21: RVV_SEW(RVV_OP, b == 0 ? (U)~0 : (S)b == -1 ? (U)(0 - a) : (U)((S)a / (S)b)); break; // vdiv
+        case 0x22: RVV_SEW(RVV_OP, b ? a % b : a); break; // vremu
+        case 0x23: RVV_SEW(RVV_OP, b == 0 ? a : (S)b == -1 ? 0 : (U)((S)a % (S)b)); break; // vrem
+        case 0x24: RVV_SEW(RVV_OP, ((uint64_t)a * b) >> RVV_BITS(U)); break; // vmulhu
+        case 0x25: RVV_SEW(RVV_OP, a * b); break; // vmul
+        case 0x26: RVV_SEW(RVV_OP, ((int64_t)(S)a * (int64_t)b) >> RVV_BITS(U)); break; // vmulhsu
+        case 0x27: RVV_SEW(RVV_OP, ((int64_t)(S)a * (S)b) >> RVV_BITS(U)); break; // vmulh
+        case 0x29: RVV_SEW(RVV_OP, b * c + a); break; // vmadd
+        case 0x2B: RVV_SEW(RVV_OP, a - b * c); break; // vnmsub
+        case 0x2D: RVV_SEW(RVV_OP, b * a + c); break; // vmacc
+        case 0x2F: RVV_SEW(RVV_OP, c - b * a); break; // vnmsac
+        }
+        break;
+    case 1: case 5: // opfvv, opfvf
+        if (sew != 32) break;
+        switch (inst_funct6) {
+        case 0x00: RVV_FOP(a + b); break; // vfadd
+        case 0x01: case 0x03: // vfredusum, vfredosum, summed in order
+            if (inst_funct3 == 1) { float s = ((float*)vs1)[0]; RVV_EACH(s += ((float*)vs2)[i]); if (vl) ((float*)vd)[0] = s != s ? fp_u2s(FP_NAN_S) : s; }
+            break;
+        case 0x02: RVV_FOP(a - b); break; // vfsub
+        case 0x04: RVV_FOP(fp_u2s(fp_minmax_s(fp_s2u(a), fp_s2u(b), 0))); break; // vfmin
+        case 0x05: if (inst_funct3 == 1) { uint32_t s = ((uint32_t*)vs1)[0]; RVV_EACH(s = fp_minmax_s(s, ((uint32_t*)vs2)[i], 0)); if (vl) ((uint32_t*)vd)[0] = s; } break; // vfredmin
+        case 0x06: RVV_FOP(fp_u2s(fp_minmax_s(fp_s2u(a), fp_s2u(b), 1))); break; // vfmax
+        case 0x07: if (inst_funct3 == 1) { uint32_t s = ((uint32_t*)vs1)[0]; RVV_EACH(s = fp_minmax_s(s, ((uint32_t*)vs2)[i], 1)); if (vl) ((uint32_t*)vd)[0] = s; } break; // vfredmax
+        case 0x08: RVV_OP(uint32_t, int32_t, (a & 0x7fffffffu) | ( b & 0x80000000u)); break; // vfsgnj
+        case 0x09: RVV_OP(uint32_t, int32_t, (a & 0x7fffffffu) | (~b & 0x80000000u)); break; // vfsgnjn
+        case 0x0A: RVV_OP(uint32_t, int32_t, a ^ (b & 0x80000000u)); break; // vfsgnjx
+        case 0x0E: if (inst_funct3 == 5 && inst_rd != inst_rs2) RVV_OP(uint32_t, int32_t, i ? ((uint32_t*)vs2)[i - 1] : b); break; // vfslide1up
+        case 0x0F: if (inst_funct3 == 5) RVV_OP(uint32_t, int32_t, i + 1 < vl ? ((uint32_t*)vs2)[i + 1] : b); break; // vfslide1down
+        case 0x10:
+            if (inst_funct3 == 1 && inst_rs1 == 0) riscv->f[inst_rd] = FP_BOX_S | ((uint32_t*)vs2)[0]; // vfmv.f.s
+            if (inst_funct3 == 5 && inst_rs2 == 0 && vl) ((uint32_t*)vd)[0] = sx; // vfmv.s.f
+            break;
+        case 0x12: // vfcvt
+            if (inst_funct3 != 1) break;
+            switch (inst_rs1) {
+            case 0: case 1: case 6: case 7: // vfcvt.xu.f.v, vfcvt.x.f.v, vfcvt.rtz.xu.f.v, vfcvt.rtz.x.f.v
+                m = riscv_fp_round(riscv, inst_rs1 & 4 ? 1 : 7);
+                RVV_EACH(((uint32_t*)vd)[i] = fp_cvt_w(fp_isnan_s(((uint32_t*)vs2)[i]) ? 0 : ((float*)vs2)[i], m, fp_isnan_s(((uint32_t*)vs2)[i]), !(inst_rs1 & 1)));
+                break;
+            case 2: RVV_EACH(((float*)vd)[i] = (float)((uint32_t*)vs2)[i]); break; // vfcvt.f.xu.v
+            case 3: RVV_EACH(((float*)vd)[i] = (float)((int32_t *)vs2)[i]); break; // vfcvt.f.x.v
+            }
+            break;
+        case 0x13: if (inst_funct3 == 1 && inst_rs1 == 0) RVV_FOP(sqrtf(a)); break; // vfsqrt
+        case 0x17: m = vm, vm = 1; if (inst_funct3 == 5) RVV_OP(uint32_t, int32_t, m || rvv_mask(riscv, i) ? b : a); break; // vfmerge, vfmv.v.f
+        case 0x18: RVV_FCMP(a == b); break; // vmfeq
+        case 0x19: RVV_FCMP(a <= b); break; // vmfle
+        case 0x1B: RVV_FCMP(a <  b); break; // vmflt
+        case 0x1C: RVV_FCMP(a != b); break; // vmfne
+        case 0x1D: if (inst_funct3 == 5) RVV_FCMP(a >  b); break; // vmfgt
+        case 0x1F: if (inst_funct3 == 5) RVV_FCMP(a >= b); break; // vmfge
+        case 0x20: RVV_FOP(a / b); break; // vfdiv
+        case 0x21: if (inst_funct3 == 5) RVV_FOP(b / a); break; // vfrdiv
+        case 0x24: RVV_FOP(a * b); break; // vfmul
+        case 0x27: if (inst_funct3 == 5) RVV_FOP(b - a); break; // vfrsub
+        case 0x28: RVV_FOP(fmaf( b, c,  a)); break; // vfmadd
+        case 0x29: RVV_FOP(fmaf(-b, c, -a)); break; // vfnmadd
+        case 0x2A: RVV_FOP(fmaf( b, c, -a)); break; // vfmsub
+        case 0x2B: RVV_FOP(fmaf(-b, c,  a)); break; // vfnmsub
+        case 0x2C: RVV_FOP(fmaf( b, a,  c)); break; // vfmacc
+        case 0x2D: RVV_FOP(fmaf(-b, a, -c)); break; // vfnmacc
+        case 0x2E: RVV_FOP(fmaf( b, a, -c)); break; // vfmsac
+        case 0x2F: RVV_FOP(fmaf(-b, a,  c)); break; // vfnmsac
+        }
+        break;
+    }
+}
+
+// a csr of a more privileged mode is an illegal instruction, so are the counters a lower mode isn't given in
+// mcounteren and scounteren, and satp in s-mode with mstatus:tvm. the s-mode views of the m-mode csrs are brought
+// up to date for the read
+static void riscv_csr_read(RISCV *riscv, uint32_t csr, uint32_t instruction)
+{
+    uint32_t *c = riscv->csr, bit = 1u << (csr & 0x1F);
+    if (((csr >> 8) & 0x3) > riscv->priv) riscv_fault(riscv, EXCP_ILLEGAL_INST, instruction);
+    if ((csr & 0xF60) == RISCV_CSR_CYCLE && ((riscv->priv < RISCV_PRIV_M && !(c[RISCV_CSR_MCOUNTEREN] & bit)) || (riscv->priv == RISCV_PRIV_U && !(c[RISCV_CSR_SCOUNTEREN] & bit)))) {
+        riscv_fault(riscv, EXCP_ILLEGAL_INST, instruction);
+    }
+    if (csr == RISCV_CSR_SATP && riscv->priv == RISCV_PRIV_S && (c[RISCV_CSR_MSTATUS] & RISCV_MSTATUS_TVM)) riscv_fault(riscv, EXCP_ILLEGAL_INST, instruction);
+    switch (csr) {
+    case RISCV_CSR_SSTATUS: c[RISCV_CSR_SSTATUS] = c[RISCV_CSR_MSTATUS] & RISCV_SSTATUS_MASK; break;
+    case RISCV_CSR_SIE    : c[RISCV_CSR_SIE    ] = c[RISCV_CSR_MIE    ] & c[RISCV_CSR_MIDELEG]; break;
+    case RISCV_CSR_MIP    :
+    case RISCV_CSR_SIP    :
+        riscv->mtimecur = ffvm_mtime(riscv);
+        c[RISCV_CSR_SIP] = riscv_mip(riscv) & c[RISCV_CSR_MIDELEG];
+        break;
+    }
+}
+
+// what a csr write does besides, old is the value before it
+static void riscv_csr_write(RISCV *riscv, uint32_t csr, uint32_t old)
+{
+    uint32_t *c = riscv->csr, mst = c[RISCV_CSR_MSTATUS], bit;
+    switch (csr) {
+    case RISCV_CSR_SSTATUS:
+        c[RISCV_CSR_MSTATUS] = (mst & ~RISCV_SSTATUS_MASK) | (c[RISCV_CSR_SSTATUS] & RISCV_SSTATUS_MASK);
+        old = mst; // fall through
+    case RISCV_CSR_MSTATUS:
+        if ((c[RISCV_CSR_MSTATUS] & RISCV_MSTATUS_MPP) == (2 << 11)) c[RISCV_CSR_MSTATUS] &= ~RISCV_MSTATUS_MPP; // no h-mode
+        c[RISCV_CSR_MSTATUS] |= RISCV_MSTATUS_FS | RISCV_MSTATUS_SD;
+        if ((c[RISCV_CSR_MSTATUS] ^ old) & RISCV_MSTATUS_MXR) riscv_tlb_flush(riscv, RISCV_TLB_VM, 0, 0);
+        riscv_tlb_select(riscv);
+        riscv->irq_pending = 1;
+        break;
+    case RISCV_CSR_SIE    : c[RISCV_CSR_MIE] = (c[RISCV_CSR_MIE] & ~c[RISCV_CSR_MIDELEG]) | (c[RISCV_CSR_SIE] & c[RISCV_CSR_MIDELEG]); riscv->irq_pending = 1; break;
+    case RISCV_CSR_SIP    : // a bit changes where the value written differs from the one read, as seip reads the plic too
+    case RISCV_CSR_MIP    : // and other harts set ssip for the sbi ipis
+        bit = (c[csr] ^ old) & (csr == RISCV_CSR_SIP ? c[RISCV_CSR_MIDELEG] & (1 << INTR_SUPERVISOR_SOFTWARE) : RISCV_MIP_SOFT);
+        __atomic_or_fetch (&riscv->mip_soft,  (bit & c[csr]), __ATOMIC_RELAXED);
+        __atomic_and_fetch(&riscv->mip_soft, ~(bit & old   ), __ATOMIC_RELAXED);
+        c[RISCV_CSR_MIP] = riscv_mip(riscv);
+        riscv->irq_pending = 1;
+        break;
+    case RISCV_CSR_MIDELEG: c[RISCV_CSR_MIDELEG] &= RISCV_MIP_SOFT; riscv->irq_pending = 1; break;
+    case RISCV_CSR_MEDELEG: c[RISCV_CSR_MEDELEG] &= ~(1 << 11); break; // ecall from m-mode stays there
+    case RISCV_CSR_SATP   : c[RISCV_CSR_SATP   ] &= 0x803FFFFF; riscv_tlb_flush(riscv, RISCV_TLB_VM, 0, 0); break; // no asids
+    }
+    if ((csr & 0xFE0) == RISCV_CSR_PMPCFG0) riscv_pmp_write(riscv, csr, old);
+}
+
+// a hart the sbi starts, in s-mode at addr with a0 - hartid, a1 - opaque, the device tree for the boot hart. the
+// exceptions but the ecalls from s-mode and m-mode and the supervisor interrupts are delegated, the timer raises stip
+static void ffvm_sbi_hart_boot(RISCV *riscv, uint32_t addr, uint32_t opaque)
+{
+    riscv->pc    = addr;
+    riscv->priv  = RISCV_PRIV_S;
+    riscv->x[10] = riscv->csr[RISCV_CSR_MHARTID];
+    riscv->x[11] = opaque;
+    riscv->csr[RISCV_CSR_SATP      ] = 0;
+    riscv->csr[RISCV_CSR_MSTATUS   ]&= ~RISCV_MSTATUS_SIE;
+    riscv->csr[RISCV_CSR_MEDELEG   ] = 0xFFFF & ~((1 << 9) | (1 << 10) | (1 << 11) | (1 << 14));
+    riscv->csr[RISCV_CSR_MIDELEG   ] = RISCV_MIP_SOFT;
+    riscv->csr[RISCV_CSR_MCOUNTEREN] = 0x7; // cycle, time and instret
+    riscv->mtip = 1 << INTR_SUPERVISOR_TIMER;
+    riscv_tlb_flush (riscv, RISCV_TLB_VM, 0, 0);
+    riscv_tlb_select(riscv);
+    __atomic_store_n(&riscv->hsm, FFVM_HSM_STARTED, __ATOMIC_RELEASE);
+}
+
+// the harts in an sbi hart mask, all of them if the base is -1
+static uint32_t ffvm_sbi_harts(RISCV *riscv, uint32_t mask, uint32_t base)
+{
+    uint32_t all = (1u << riscv->mach->nharts) - 1;
+    return base == 0xFFFFFFFF ? all : base < 32 ? (mask << base) & all : 0;
+}
+
+static void ffvm_sbi_ipi(RISCV *riscv, uint32_t harts)
+{
+    for (uint32_t i = 0; i < riscv->mach->nharts; i++) {
+        if (!((harts >> i) & 1)) continue;
+        __atomic_or_fetch(&riscv->mach->harts[i]->mip_soft, 1 << INTR_SUPERVISOR_SOFTWARE, __ATOMIC_RELAXED);
+        if (riscv->mach->harts[i] == riscv) riscv->irq_pending = 1;
+        else ffvm_irq_notify(riscv->mach->harts[i]);
+    }
+}
+
+// the tlbs of another hart are only touched by its own thread, it flushes them at the end of its block and the
+// caller waits for that, handling the requests it gets meanwhile. a stopped hart flushes before it runs again
+static void ffvm_sbi_rfence(RISCV *riscv, uint32_t harts)
+{
+    RISCV   *mach = riscv->mach, *hart;
+    uint32_t i;
+    for (i = 0; i < mach->nharts; i++) {
+        if (!((harts >> i) & 1)) continue;
+        if ((hart = mach->harts[i]) == riscv) { riscv_tlb_flush(riscv, RISCV_TLB_VM, 0, 0); continue; }
+        __atomic_store_n(&hart->tlb_shoot, 1, __ATOMIC_RELEASE);
+        ffvm_irq_notify(hart);
+    }
+    for (i = 0; i < mach->nharts; i++) {
+        if (!((harts >> i) & 1) || (hart = mach->harts[i]) == riscv) continue;
+        while (__atomic_load_n(&hart->tlb_shoot, __ATOMIC_ACQUIRE) && !__atomic_load_n(&hart->hsm, __ATOMIC_RELAXED) && mach->cpu_freq) {
+            if (__atomic_load_n(&riscv->tlb_shoot, __ATOMIC_ACQUIRE)) riscv_tlb_flush(riscv, RISCV_TLB_VM, 0, 0), __atomic_store_n(&riscv->tlb_shoot, 0, __ATOMIC_RELEASE);
+            sched_yield();
+        }
+    }
+}
+
+static int32_t ffvm_sbi_hsm(RISCV *riscv, uint32_t fid, uint32_t id, uint32_t addr, uint32_t opaque, uint32_t *val)
+{
+    RISCV  *hart;
+    int32_t err = 0;
+    if (fid == 1) { riscv->hsm = FFVM_HSM_STOPPED; riscv_slice_break(riscv); return 0; } // hart_stop, the caller
+    if (fid > 2) return FFVM_SBI_ERR_NOT_SUPPORTED;
+    if (id >= riscv->mach->nharts) return FFVM_SBI_ERR_INVALID_PARAM;
+    hart = riscv->mach->harts[id];
+    ffvm_lock(riscv);
+    if (fid == 2) *val = hart->hsm; // hart_get_status
+    else if (hart->hsm != FFVM_HSM_STOPPED) err = FFVM_SBI_ERR_ALREADY_AVAILABLE;
+    else { // hart_start, the hart sets itself up, see riscv_run_slice
+        hart->hsm_addr   = addr;
+        hart->hsm_opaque = opaque;
+        __atomic_store_n(&hart->hsm, FFVM_HSM_START_PENDING, __ATOMIC_RELEASE);
+        ffvm_wfi_kick(hart);
+    }
+    ffvm_unlock(riscv);
+    return err;
+}
+
+static int ffvm_sbi_probe(uint32_t eid)
+{
+    switch (eid) {
+    case FFVM_SBI_EXT_BASE: case FFVM_SBI_EXT_TIME: case FFVM_SBI_EXT_IPI: case FFVM_SBI_EXT_RFNC:
+    case FFVM_SBI_EXT_HSM : case FFVM_SBI_EXT_SRST: case FFVM_SBI_EXT_DBCN: return 1;
+    }
+    return eid <= 8; // the legacy ones
+}
+
+// the built-in sbi serves the ecalls of s-mode as the m-mode firmware would. a7 is the extension, a6 the function,
+// the error goes to a0 and the value to a1, the legacy extensions return either in a0. the console is ffvm's stdio
+static void ffvm_sbi_call(RISCV *riscv)
+{
+    uint32_t *x = riscv->x, eid = x[17], fid = x[16], val = 0, i;
+    int32_t   err = 0;
+    int       c;
+    switch (eid) {
+    case 0x0: riscv->mtimecmp = x[10] | (uint64_t)x[11] << 32; riscv->irq_pending = 1; riscv_slice_break(riscv); x[10] = 0; return; // set_timer
+    case 0x1: fputc(x[10], stdout); x[10] = 0; return; // console_putchar
+    case 0x2: x[10] = console_getc(); return; // console_getchar
+    case 0x3: __atomic_and_fetch(&riscv->mip_soft, ~(1 << INTR_SUPERVISOR_SOFTWARE), __ATOMIC_RELAXED); x[10] = 0; return; // clear_ipi
+    case 0x4: ffvm_sbi_ipi(riscv, ffvm_sbi_harts(riscv, x[10] ? riscv_memr32(riscv, x[10]) : 0, x[10] ? 0 : -1)); x[10] = 0; return; // send_ipi, a0 points to the mask
+    case 0x5: x[10] = 0; return; // remote_fence_i
+    case 0x6: case 0x7: ffvm_sbi_rfence(riscv, ffvm_sbi_harts(riscv, x[10] ? riscv_memr32(riscv, x[10]) : 0, x[10] ? 0 : -1)); x[10] = 0; return;
+    case 0x8: ffvm_lock(riscv); ffvm_mmio_write(riscv, REG_FFVM_CPU_FREQ, 0); ffvm_unlock(riscv); return; // shutdown
+    case FFVM_SBI_EXT_BASE:
+        switch (fid) {
+        case 0: val = FFVM_SBI_SPEC_VERSION; break;
+        case 1: val = FFVM_SBI_IMPL_ID; break;
+        case 2: val = 1; break;
+        case 3: val = ffvm_sbi_probe(x[10]); break;
+        case 4: case 5: case 6: val = 0; break; // mvendorid, marchid and mimpid
+        default: err = FFVM_SBI_ERR_NOT_SUPPORTED; break;
+        }
+        break;
+    case FFVM_SBI_EXT_TIME:
+        if (fid == 0) riscv->mtimecmp = x[10] | (uint64_t)x[11] << 32, riscv->irq_pending = 1, riscv_slice_break(riscv);
+        else err = FFVM_SBI_ERR_NOT_SUPPORTED;
+        break;
+    case FFVM_SBI_EXT_IPI:
+        if (fid == 0) ffvm_sbi_ipi(riscv, ffvm_sbi_harts(riscv, x[10], x[11]));
+        else err = FFVM_SBI_ERR_NOT_SUPPORTED;
+        break;
+    case FFVM_SBI_EXT_RFNC: // fence.i has nothing to do, the asids are ignored
+        if (fid == 1 || fid == 2) ffvm_sbi_rfence(riscv, ffvm_sbi_harts(riscv, x[10], x[11]));
+        else if (fid != 0) err = FFVM_SBI_ERR_NOT_SUPPORTED;
+        break;
+    case FFVM_SBI_EXT_HSM: err = ffvm_sbi_hsm(riscv, fid, x[10], x[11], x[12], &val); break;
+    case FFVM_SBI_EXT_SRST: // shutdown and the reboots alike stop the machine
+        if (fid == 0 && x[10] <= 2) { ffvm_lock(riscv); ffvm_mmio_write(riscv, REG_FFVM_CPU_FREQ, 0); ffvm_unlock(riscv); }
+        else err = FFVM_SBI_ERR_INVALID_PARAM;
+        break;
+    case FFVM_SBI_EXT_DBCN: // the buffers are physical addresses in the ram
+        if (fid == 2) { fputc(x[10] & 0xFF, stdout); break; }
+        if (fid > 2) { err = FFVM_SBI_ERR_NOT_SUPPORTED; break; }
+        if (x[12] || x[11] >= REG_FFVM_STDIO || x[11] + (uint64_t)x[10] > REG_FFVM_STDIO) { err = FFVM_SBI_ERR_INVALID_PARAM; break; }
+        for (i = 0; i < x[10]; i++) {
+            if (fid == 0) fputc(riscv->mem[(x[11] + i) & riscv->mem_mask], stdout);
+            else if ((c = console_getc()) != EOF) riscv->mem[(x[11] + i) & riscv->mem_mask] = c, riscv_resv_kill(riscv, (x[11] + i) & riscv->mem_mask);
+            else break;
+        }
+        val = i;
+        break;
+    default: err = FFVM_SBI_ERR_NOT_SUPPORTED; break;
+    }
+    x[10] = err;
+    x[11] = val;
 }
 
-static void riscv_execute_rv32(RISCV *riscv, uint32_t instruction)
+static uint32_t riscv_execute_rv32(RISCV *riscv, uint32_t instruction)
 {
     const uint32_t inst_opcode = (instruction >>  0) & 0x7f;
     const uint32_t inst_rd     = (instruction >>  7) & 0x1f;
@@ -681,6 +2394,7 @@ static void riscv_execute_rv32(RISCV *riscv, uint32_t instruction)
         }
         break;
     case 0x13: // i-type
+        if ((inst_funct3 == 1 && inst_funct7) || (inst_funct3 == 5 && (inst_funct7 & ~0x20))) { riscv_execute_zb(riscv, instruction); break; }
         switch (inst_funct3) {
         case 0x0: riscv->x[inst_rd] = riscv->x[inst_rs1] + signed_extend(inst_imm12i, 12); break; // addi
         case 0x2: riscv->x[inst_rd] = (int32_t)riscv->x[inst_rs1] < signed_extend(inst_imm12i, 12);  break; // slti
@@ -699,6 +2413,7 @@ static void riscv_execute_rv32(RISCV *riscv, uint32_t instruction)
         }
         break;
     case 0x33: // r-type
+        if ((inst_funct7 & ~0x21) || (inst_funct7 == 0x20 && inst_funct3 != 0 && inst_funct3 != 5)) { riscv_execute_zb(riscv, instruction); break; }
         if ((inst_funct7 & (1 << 0)) == 0) {
             switch (inst_funct3) {
             case 0x0: // add & sub
@@ -752,23 +2467,66 @@ static void riscv_execute_rv32(RISCV *riscv, uint32_t instruction)
             }
         }
         break;
+    case 0x07: case 0x27: // fp or vector loads/stores, by width
+        if (inst_funct3 == 2 || inst_funct3 == 3) riscv_execute_fp (riscv, instruction);
+        else                                       riscv_execute_rvv(riscv, instruction);
+        break;
+    case 0x43: case 0x47: case 0x4b: case 0x4f: case 0x53:
+        riscv_execute_fp(riscv, instruction);
+        break;
+    case 0x57:
+        riscv_execute_rvv(riscv, instruction);
+        break;
     case 0x73:
+        if (inst_funct3) riscv_csr_read(riscv, inst_csr, instruction);
+        temp = riscv->csr[inst_csr];
+        if (inst_funct3 && inst_csr >= RISCV_CSR_FFLAGS && inst_csr <= RISCV_CSR_FCSR) {
+            riscv_fp_flags(riscv);
+            riscv->csr[RISCV_CSR_FCSR] = (riscv->csr[RISCV_CSR_FRM] << 5) | riscv->csr[RISCV_CSR_FFLAGS];
+        }
+        if (inst_funct3 && inst_csr == RISCV_CSR_VCSR) riscv->csr[RISCV_CSR_VCSR] = (riscv->csr[RISCV_CSR_VXRM] << 1) | riscv->csr[RISCV_CSR_VXSAT];
+        if (inst_funct3 && (inst_csr & 0xF7C) == RISCV_CSR_MCYCLE) riscv_counter_sync(riscv);
+        if (inst_funct3 && (inst_csr & 0xF7C) == RISCV_CSR_CYCLE ) riscv_counter_sync(riscv);
         switch (inst_funct3) {
         case 0:
             if (inst_csr == 0) { // ecall
-                riscv->csr[RISCV_CSR_MCAUSE] = 11; // ecall from m-mode
-                riscv->csr[RISCV_CSR_MEPC]   = riscv->pc;
-                riscv->pc = riscv->csr[RISCV_CSR_MTVEC] & ~0x3;
+                if (riscv->priv == RISCV_PRIV_S && riscv->mach->sbi) ffvm_sbi_call(riscv), riscv->pc += 4; // served by the built-in sbi
+                else riscv_trap(riscv, 8 + riscv->priv, 0); // ecall from u-mode, s-mode or m-mode
                 bflag = 1;
             } else if (inst_csr == 1) { // ebreak
+            } else if (inst_csr == 0x105) { // wfi
+                if (riscv->priv == RISCV_PRIV_U || (riscv->priv == RISCV_PRIV_S && (riscv->csr[RISCV_CSR_MSTATUS] & RISCV_MSTATUS_TW))) riscv_fault(riscv, EXCP_ILLEGAL_INST, instruction);
+                riscv->wfi = 1; riscv_slice_break(riscv);
             } else if (inst_csr == 0x302) { // mret
+                if (riscv->priv != RISCV_PRIV_M) riscv_fault(riscv, EXCP_ILLEGAL_INST, instruction);
                 bflag = 1;
-                riscv->pc = riscv->csr[RISCV_CSR_MEPC];
+                riscv->mreserved = RISCV_RESERVED_NONE;
+                riscv->pc   = riscv->csr[RISCV_CSR_MEPC];
+                riscv->priv = (riscv->csr[RISCV_CSR_MSTATUS] & RISCV_MSTATUS_MPP) >> 11;
                 //+ restore mstatus:mie, mstatus:mie = mstatus:mpie
                 riscv->csr[RISCV_CSR_MSTATUS] &=~(1 << 3);
                 riscv->csr[RISCV_CSR_MSTATUS] |= (riscv->csr[RISCV_CSR_MSTATUS] & (1 << 7)) >> 4;
                 //- restore mstatus:mie, mstatus:mie = mstatus:mpie
                 riscv->csr[RISCV_CSR_MSTATUS] |= (1 << 7);
+                // mstatus:mpp is kept, the m-mode only roms mret into their tasks without a trap in between
+                if (riscv->priv != RISCV_PRIV_M) riscv->csr[RISCV_CSR_MSTATUS] &= ~RISCV_MSTATUS_MPRV;
+                riscv_tlb_select(riscv);
+                riscv->irq_pending = 1;
+            } else if (inst_csr == 0x102) { // sret
+                if (riscv->priv == RISCV_PRIV_U || (riscv->priv == RISCV_PRIV_S && (riscv->csr[RISCV_CSR_MSTATUS] & RISCV_MSTATUS_TSR))) riscv_fault(riscv, EXCP_ILLEGAL_INST, instruction);
+                bflag = 1;
+                riscv->mreserved = RISCV_RESERVED_NONE;
+                riscv->pc   = riscv->csr[RISCV_CSR_SEPC];
+                riscv->priv = (riscv->csr[RISCV_CSR_MSTATUS] & RISCV_MSTATUS_SPP) >> 8;
+                //+ sstatus:sie = sstatus:spie, sstatus:spie = 1, sstatus:spp = u-mode
+                riscv->csr[RISCV_CSR_MSTATUS] &=~(RISCV_MSTATUS_SIE | RISCV_MSTATUS_SPP | RISCV_MSTATUS_MPRV);
+                riscv->csr[RISCV_CSR_MSTATUS] |= (riscv->csr[RISCV_CSR_MSTATUS] & RISCV_MSTATUS_SPIE) >> 4;
+                riscv->csr[RISCV_CSR_MSTATUS] |= RISCV_MSTATUS_SPIE;
+                riscv_tlb_select(riscv);
+                riscv->irq_pending = 1;
+            } else if ((instruction >> 25) == 0x09) { // sfence.vma, the asid isn't looked at
+                if (riscv->priv == RISCV_PRIV_U || (riscv->priv == RISCV_PRIV_S && (riscv->csr[RISCV_CSR_MSTATUS] & RISCV_MSTATUS_TVM))) riscv_fault(riscv, EXCP_ILLEGAL_INST, instruction);
+                riscv_tlb_flush(riscv, RISCV_TLB_VM, inst_rs1 != 0, riscv->x[inst_rs1]);
             }
             break;
         case 1: riscv->x[inst_rd] = riscv->csr[inst_csr]; if ((inst_csr >> 10) != 3) riscv->csr[inst_csr] = riscv->x[inst_rs1]; break; // csrrw
@@ -778,79 +2536,555 @@ static void riscv_execute_rv32(RISCV *riscv, uint32_t instruction)
         case 6: riscv->x[inst_rd] = riscv->csr[inst_csr]; if ((inst_csr >> 10) != 3 && inst_rs1) riscv->csr[inst_csr] |= inst_rs1; break; // csrrsi
         case 7: riscv->x[inst_rd] = riscv->csr[inst_csr]; if ((inst_csr >> 10) != 3 && inst_rs1) riscv->csr[inst_csr] &=~inst_rs1; break; // csrrci
         }
+        if (inst_funct3 && (inst_csr == RISCV_CSR_MSTATUS || inst_csr == RISCV_CSR_MIE)) riscv->irq_pending = 1;
+        if (inst_funct3 && inst_csr == RISCV_CSR_MIE) riscv_slice_break(riscv);
+        if (inst_funct3 && ((inst_funct3 & 0x3) == 1 || inst_rs1)) riscv_csr_write(riscv, inst_csr, temp);
+        if (inst_funct3 && inst_csr >= RISCV_CSR_FFLAGS && inst_csr <= RISCV_CSR_FCSR) {
+            if (inst_csr == RISCV_CSR_FCSR) riscv->csr[RISCV_CSR_FFLAGS] = riscv->csr[RISCV_CSR_FCSR], riscv->csr[RISCV_CSR_FRM] = riscv->csr[RISCV_CSR_FCSR] >> 5;
+            riscv->csr[RISCV_CSR_FFLAGS] &= 0x1f;
+            riscv->csr[RISCV_CSR_FRM   ] &= 0x7;
+            riscv->csr[RISCV_CSR_FCSR  ]  = (riscv->csr[RISCV_CSR_FRM] << 5) | riscv->csr[RISCV_CSR_FFLAGS];
+        }
+        if (inst_funct3 && inst_csr >= RISCV_CSR_VSTART && inst_csr <= RISCV_CSR_VCSR) {
+            if (inst_csr == RISCV_CSR_VCSR) riscv->csr[RISCV_CSR_VXSAT] = riscv->csr[RISCV_CSR_VCSR], riscv->csr[RISCV_CSR_VXRM] = riscv->csr[RISCV_CSR_VCSR] >> 1;
+            riscv->csr[RISCV_CSR_VSTART] = 0;
+            riscv->csr[RISCV_CSR_VXSAT ] &= 0x1;
+            riscv->csr[RISCV_CSR_VXRM  ] &= 0x3;
+            riscv->csr[RISCV_CSR_VCSR  ]  = (riscv->csr[RISCV_CSR_VXRM] << 1) | riscv->csr[RISCV_CSR_VXSAT];
+        }
+        if (inst_funct3 && ((inst_funct3 & 0x3) == 1 || inst_rs1)) { // a write, it takes effect after this instruction
+            if (inst_csr == RISCV_CSR_MCYCLE   || inst_csr == RISCV_CSR_MCYCLEH  ) riscv->cycle_off   = ((uint64_t)riscv->csr[RISCV_CSR_MCYCLEH  ] << 32 | riscv->csr[RISCV_CSR_MCYCLE  ]) - (riscv->mcycle + 1);
+            if (inst_csr == RISCV_CSR_MINSTRET || inst_csr == RISCV_CSR_MINSTRETH) riscv->instret_off = ((uint64_t)riscv->csr[RISCV_CSR_MINSTRETH] << 32 | riscv->csr[RISCV_CSR_MINSTRET]) - (riscv->mcycle + 1 - riscv->cycle_idle);
+        }
         break;
     case 0x2f:
-        if (inst_funct3 == 0x2) {
-            temp = riscv_memr32(riscv, riscv->x[inst_rs1]);
-            switch (instruction >> 27) {
-            case 0x02: riscv->mreserved = riscv->x[inst_rs1]; break; // lr.w
-            case 0x03: // sc.w
-                if (riscv->mreserved == riscv->x[inst_rs1]) riscv_memw32(riscv, riscv->x[inst_rs1], riscv->x[inst_rs2]);
-                temp = !(riscv->mreserved == riscv->x[inst_rs1]);
-                break;
-            case 0x01: riscv_memw32(riscv, riscv->x[inst_rs1], riscv->x[inst_rs2]); break; // amoswap.w
-            case 0x00: riscv_memw32(riscv, riscv->x[inst_rs1], temp + riscv->x[inst_rs2]); break; // amoadd.w
-            case 0x04: riscv_memw32(riscv, riscv->x[inst_rs1], temp ^ riscv->x[inst_rs2]); break; // amoxor.w
-            case 0x0c: riscv_memw32(riscv, riscv->x[inst_rs1], temp & riscv->x[inst_rs2]); break; // amoand.w
-            case 0x08: riscv_memw32(riscv, riscv->x[inst_rs1], temp | riscv->x[inst_rs2]); break; // amoor.w
-            case 0x10: riscv_memw32(riscv, riscv->x[inst_rs1], (int32_t)temp < (int32_t)riscv->x[inst_rs2] ? temp : riscv->x[inst_rs2]); break; // amomin.w
-            case 0x14: riscv_memw32(riscv, riscv->x[inst_rs1], (int32_t)temp > (int32_t)riscv->x[inst_rs2] ? temp : riscv->x[inst_rs2]); break; // amomax.w
-            case 0x18: riscv_memw32(riscv, riscv->x[inst_rs1], temp < riscv->x[inst_rs2] ? temp : riscv->x[inst_rs2]); break; // amominu.w
-            case 0x1c: riscv_memw32(riscv, riscv->x[inst_rs1], temp > riscv->x[inst_rs2] ? temp : riscv->x[inst_rs2]); break; // amomaxu.w
-            }
-            riscv->x[inst_rd] = temp;
-        }
+        if (inst_funct3 == 0x2) riscv->x[inst_rd] = riscv_amo32(riscv, instruction >> 27, riscv->x[inst_rs1], riscv->x[inst_rs2]);
         break;
     case 0x0f:
         if (instruction == 0x0000100f) { // fence.i
-            // todo...
-        } else if ((instruction & 0xf00fff80) == 0) { // fence
-            // todo...
+            // nothing is cached
+        } else if ((instruction & 0xf00fff80) == 0) { // fence, orders the accesses seen by the other harts
+            __atomic_thread_fence(__ATOMIC_SEQ_CST);
         }
         break;
     }
     riscv->pc += bflag ? 0 : 4;
+    return bflag;
+}
+
+// the halves of a fetch that misses in the tlb or crosses a page, the second one only if it's needed. there is no
+// executing the mmio
+static __attribute__((noinline)) uint32_t riscv_fetch_slow(RISCV *riscv, uint32_t pc)
+{
+    uint32_t inst, pa;
+    if ((pa = riscv_translate(riscv, pc, RISCV_PMP_FETCH)) >= REG_FFVM_STDIO) riscv_fault(riscv, 1, pc);
+    inst = *(uint16_t*)(riscv->mem + (pa & riscv->mem_mask));
+    if ((inst & 0x3) != 0x3) return inst;
+    if ((pa = riscv_translate(riscv, pc + 2, RISCV_PMP_FETCH)) >= REG_FFVM_STDIO) riscv_fault(riscv, 1, pc + 2);
+    return inst | (*(uint16_t*)(riscv->mem + (pa & riscv->mem_mask)) << 16);
+}
+
+// instruction fetch, with rvc the pc is only 2 byte aligned, a fetch that hits in the tlb is one host load unless
+// it crosses a page
+static inline uint32_t riscv_fetch(RISCV *riscv, uint32_t pc)
+{
+    TLBENTRY *e = riscv_tlb(riscv, RISCV_PMP_FETCH, pc);
+    uint32_t inst;
+    if (e->vpn != pc >> 12 || (pc & 0xFFF) > 0xFFC) return riscv_fetch_slow(riscv, pc);
+    memcpy(&inst, (uint8_t*)(e->addend + pc), sizeof(inst));
+    return inst;
 }
 
 void riscv_run(RISCV *riscv)
 {
-    const uint32_t instruction = riscv_memr32(riscv, riscv->pc);
+    const uint32_t instruction = riscv_fetch(riscv, riscv->pc);
+    uint32_t bflag;
     if ((instruction & 0x3) != 0x3) {
-        riscv_execute_rv16(riscv, (uint16_t)instruction);
+        bflag = riscv_execute_rv16(riscv, (uint16_t)instruction);
     } else {
-        riscv_execute_rv32(riscv, (uint32_t)instruction);
+        bflag = riscv_execute_rv32(riscv, (uint32_t)instruction);
     }
     riscv->x[0] = 0;
+    if (bflag && riscv->irq_pending && __atomic_exchange_n(&riscv->irq_pending, 0, __ATOMIC_ACQUIRE)) { // end of block
+        riscv->mtimecur = ffvm_mtime(riscv);
+        riscv_interrupt(riscv);
+    }
 }
 
-RISCV* riscv_init(char *rom, char *disk, char *ethdev)
+static __attribute__((noinline)) void riscv_run_loop(RISCV *riscv)
 {
-    FILE  *fp    = NULL;
-    RISCV *riscv = calloc(1, sizeof(RISCV));
-    if (!riscv) return NULL;
-    riscv->csr[RISCV_CSR_MISA] = (1 << 8) | (1 << 12) | (1 << 0) | (1 << 2); // misa rv32imac
+    while (riscv->mcycle < riscv->cycle_end) { riscv_run(riscv); riscv->mcycle++; }
+}
+
+// run until mcycle reaches cycle_end. an access fault has taken the trap already when it unwinds to here, the
+// faulting instruction counts and execution goes on at the handler. the loop is kept out of the function that
+// calls setjmp, which the compiler can't optimize around
+static void riscv_run_block(RISCV *riscv)
+{
+    if (setjmp(riscv->trap_jmp)) riscv->mcycle++;
+    riscv_run_loop(riscv);
+}
+
+// wfi, the hart sleeps until an interrupt enabled in mie is pending, a device event, the mtimecmp deadline or the
+// host time end (us), returns the number of cycles out of n the sleep stands for. with virtual time it just skips
+// ahead to the deadline or the end of the slice. a hart the sbi has stopped sleeps here too, till it's started
+static uint32_t riscv_wfi(RISCV *riscv, uint32_t n, uint64_t end)
+{
+    uint64_t now = get_tick_count_us(), start = now, wake = end, delta;
+    struct timespec ts;
+    riscv->mtimecur = ffvm_mtime(riscv);
+    if (!riscv->hsm && (riscv_mip(riscv) & riscv->csr[RISCV_CSR_MIE])) return 0;
+    if (!riscv->hsm && (riscv->csr[RISCV_CSR_MIE] & riscv->mtip)) {
+        if (riscv->mtimecmp - riscv->mtimecur < riscv->mtime_freq) {
+            if (riscv->vtime) {
+                delta = ((riscv->mtimecmp - riscv->mtimecur) * riscv->cpu_freq + riscv->mtime_freq - 1) / riscv->mtime_freq;
+                return delta < n ? delta : n;
+            }
+            delta = (riscv->mtimecmp - riscv->mtimecur) * 1000000 / riscv->mtime_freq;
+            wake  = now + delta < wake ? now + delta : wake;
+        }
+    }
+    if (riscv->vtime) return n;
+    pthread_mutex_lock(&riscv->wfi_lock);
+    while (now < wake && !riscv->wfi_kick && (riscv->hsm || !(riscv_mip(riscv) & riscv->csr[RISCV_CSR_MIE]))) {
+        clock_gettime(CLOCK_REALTIME, &ts);
+        delta       = ts.tv_nsec + (wake - now) * 1000;
+        ts.tv_sec  += delta / 1000000000;
+        ts.tv_nsec  = delta % 1000000000;
+        pthread_cond_timedwait(&riscv->wfi_cond, &riscv->wfi_lock, &ts);
+        now = get_tick_count_us();
+    }
+    riscv->wfi_kick = 0;
+    pthread_mutex_unlock(&riscv->wfi_lock);
+    if (now >= end) return n; // idle till the slice end, it's used up
+    delta = (now - start) * riscv->cpu_freq / 1000000;
+    return delta < n ? delta : n;
+}
+
+// run n instructions that are due to finish at host time end (us). while the timer is enabled in mie and armed,
+// the slice is split at the mtimecmp deadline, estimated at cpu_freq or the measured host rate if that's slower,
+// execution waits there for the host clock if running ahead and the interrupt is taken right away, and the slice
+// is paced to its end so the deadline can't fall into the frame sleep. a due timer masked by mstatus:mie is taken
+// at the end of the block that unmasks it, see irq_pending. with virtual time the split is exact and nothing sleeps,
+// fast forward estimates at the host rate only and never waits for the host clock. the host fpu flags and rounding
+// mode belong to the guest only while the slice runs
+static void riscv_run_slice(RISCV *riscv, uint32_t n, uint64_t end)
+{
+    uint64_t delta, tick = 0, now, start;
+    uint32_t m, i, rate, split, armed = 0;
+    feclearexcept(FE_ALL_EXCEPT);
+    while (n && riscv->cpu_freq) {
+        if (riscv->hsm) { // stopped by the sbi, the slice is slept away till a start is pending
+            if (__atomic_load_n(&riscv->hsm, __ATOMIC_ACQUIRE) == FFVM_HSM_START_PENDING) { ffvm_sbi_hart_boot(riscv, riscv->hsm_addr, riscv->hsm_opaque); continue; }
+            i = riscv_wfi(riscv, n, end);
+            n -= i, riscv->mcycle += i, riscv->cycle_idle += i;
+            continue;
+        }
+        m = n, split = 0;
+        if (riscv->csr[RISCV_CSR_MIE] & riscv->mtip) {
+            riscv->mtimecur = ffvm_mtime(riscv);
+            riscv_interrupt(riscv);
+            if (riscv->mtimecmp > riscv->mtimecur && riscv->mtimecmp - riscv->mtimecur < riscv->mtime_freq) {
+                rate  = !riscv->vtime && riscv->host_rate && (riscv->fast || riscv->host_rate < riscv->cpu_freq) ? riscv->host_rate : riscv->cpu_freq;
+                delta = ((riscv->mtimecmp - riscv->mtimecur) * rate + riscv->mtime_freq - 1) / riscv->mtime_freq;
+                if (delta < n) m = delta ? delta : 1, split = !riscv->vtime && !riscv->fast;
+                armed = !riscv->vtime && !riscv->fast;
+            }
+        }
+        tick = armed || riscv->fast ? get_tick_count_us() : 0;
+        riscv->cycle_end = (start = riscv->mcycle) + m;
+        riscv_run_block(riscv);
+        i  = riscv->mcycle - start;
+        n -= i;
+        if (tick && i >= 1000 && (now = get_tick_count_us()) > tick) {
+            rate = i * 1000000ull / (now - tick);
+            riscv->host_rate = riscv->host_rate ? (riscv->host_rate / 4 * 3 + rate / 4) : rate;
+        }
+        if (riscv->wfi) {
+            riscv->wfi = 0;
+            i = riscv_wfi(riscv, n, end);
+            n -= i, riscv->mcycle += i, riscv->cycle_idle += i;
+            if (riscv == riscv->mach) { ffvm_lock(riscv); ethphy_rx_drain(riscv); ffvm_unlock(riscv); }
+            riscv->mtimecur = ffvm_mtime(riscv);
+            riscv_interrupt(riscv);
+        } else if (split && i == m) {
+            riscv->mtimecur = ffvm_mtime(riscv);
+            if (riscv->mtimecmp > riscv->mtimecur) {
+                delta = (riscv->mtimecmp - riscv->mtimecur) * 1000000 / riscv->mtime_freq;
+                if (delta <= 1000000 / RISCV_FRAMERATE) usleep(delta); // ahead of the host clock
+            }
+        }
+        tick = 0;
+    }
+    riscv_fp_flags(riscv);
+    if (riscv->fround) fesetround(FE_TONEAREST), riscv->fround = 0;
+    if (armed && (now = get_tick_count_us()) < end) usleep(end - now);
+}
+
+// fast forward slice length, FFVM_FAST_SLICE_US of host time at the measured host rate while display, audio or
+// ethphy rx interrupts are live so they keep being serviced, ten times longer when the guest is running headless
+static uint32_t riscv_fast_slice(RISCV *riscv)
+{
+    uint64_t n = riscv->host_rate ? riscv->host_rate : riscv->cpu_freq;
+    int  live  = riscv->disp_wh || riscv->audio_out_fmt || riscv->audio_in_fmt || (riscv->irq_enable & FLAG_FFVM_IRQ_ETHPHY);
+    n = n * FFVM_FAST_SLICE_US / 1000000 * (live ? 1 : 10);
+    return n > FFVM_FAST_SLICE_MIN ? (n < 0x7FFFFFFF ? n : 0x7FFFFFFF) : FFVM_FAST_SLICE_MIN;
+}
+
+static void riscv_hart_reset(RISCV *riscv, RISCV *mach, uint32_t id)
+{
+    pthread_mutex_init(&riscv->wfi_lock, NULL);
+    pthread_cond_init (&riscv->wfi_cond, NULL);
+    riscv->mach = mach;
+    riscv->mem  = mach->mem;
+    riscv->mem_mask = mach->mem_mask;
+    riscv->reserved = mach->reserved_tab;
+    riscv->csr[RISCV_CSR_MISA] = (1 << 8) | (1 << 12) | (1 << 0) | (1 << 5) | (1 << 3) | (1 << 2) | (1 << 1) | (1 << 18) | (1 << 20); // misa rv32imafdcb, s and u modes
+    riscv->csr[RISCV_CSR_VTYPE] = 1u << 31; // vill until the first vsetvl
+    riscv->csr[RISCV_CSR_VLENB] = RISCV_VLENB;
+    riscv->csr[RISCV_CSR_MHARTID] = id;
+    riscv->mreserved = RISCV_RESERVED_NONE;
+    riscv->priv     = RISCV_PRIV_M;
+    riscv->csr[RISCV_CSR_MSTATUS] = RISCV_MSTATUS_MPP | RISCV_MSTATUS_FS | RISCV_MSTATUS_SD; // an mret with no trap before stays in m-mode
+    riscv_tlb_flush (riscv, RISCV_TLB_ALL, 0, 0);
+    riscv_tlb_select(riscv);
     riscv->pc       = 0x80000000;
     riscv->mtimecmp = 0xFFFFFFFFFFFFFFFFull;
+    riscv->mtip     = 1 << INTR_MACHINE_TIMER;
     riscv->cpu_freq = RISCV_CPU_FREQ_MAX;
-    fp = fopen(rom, "rb");
-    if (fp) {
-        fread(riscv->mem, 1, sizeof(riscv->mem), fp);
-        fclose(fp);
+    riscv->mtime_freq = FFVM_MTIME_FREQ_MIN;
+}
+
+#define ELF_PT_LOAD     1
+#define ELF_SHT_SYMTAB  2
+#define ELF_EM_RISCV    243
+
+typedef struct {
+    uint8_t  e_ident[16];
+    uint16_t e_type, e_machine;
+    uint32_t e_version, e_entry, e_phoff, e_shoff, e_flags;
+    uint16_t e_ehsize, e_phentsize, e_phnum, e_shentsize, e_shnum, e_shstrndx;
+} ELFEHDR;
+
+typedef struct {
+    uint32_t p_type, p_offset, p_vaddr, p_paddr, p_filesz, p_memsz, p_flags, p_align;
+} ELFPHDR;
+
+typedef struct {
+    uint32_t sh_name, sh_type, sh_flags, sh_addr, sh_offset, sh_size, sh_link, sh_info, sh_addralign, sh_entsize;
+} ELFSHDR;
+
+typedef struct {
+    uint32_t st_name, st_value, st_size;
+    uint8_t  st_info, st_other;
+    uint16_t st_shndx;
+} ELFSYM;
+
+static int sym_cmp(const void *a, const void *b)
+{
+    const SYMBOL *sa = a, *sb = b;
+    return sa->addr < sb->addr ? -1 : sa->addr > sb->addr;
+}
+
+static int elf_read(FILE *fp, uint32_t off, void *buf, uint32_t len)
+{
+    return fseeko(fp, off, SEEK_SET) == 0 && fread(buf, 1, len, fp) == len;
+}
+
+static void elf_load_symbols(RISCV *riscv, FILE *fp, ELFEHDR *eh)
+{
+    ELFSHDR sh, strsh;
+    ELFSYM  sym;
+    uint32_t   i, j, n;
+    int64_t    fsize;
+    if (fseeko(fp, 0, SEEK_END) != 0 || (fsize = ftello(fp)) < 0) return;
+    for (i = 0; i < eh->e_shnum; i++) {
+        if (!elf_read(fp, eh->e_shoff + i * eh->e_shentsize, &sh, sizeof(sh))) return;
+        if (sh.sh_type == ELF_SHT_SYMTAB && sh.sh_entsize >= sizeof(sym) && sh.sh_link < eh->e_shnum) break;
+    }
+    if (i == eh->e_shnum || !elf_read(fp, eh->e_shoff + sh.sh_link * eh->e_shentsize, &strsh, sizeof(strsh))) return;
+    if ((int64_t)sh.sh_offset + sh.sh_size > fsize || (int64_t)strsh.sh_offset + strsh.sh_size > fsize) return; // both in the file before malloc
+    n = sh.sh_size / sh.sh_entsize;
+    if (n > SIZE_MAX / sizeof(SYMBOL) || strsh.sh_size > SIZE_MAX - 1) return; // the sizes can't wrap on a 32-bit host either
+    riscv->sym_tab = malloc((size_t)n * sizeof(SYMBOL));
+    riscv->sym_str = malloc((size_t)strsh.sh_size + 1);
+    if (!riscv->sym_tab || !riscv->sym_str || !elf_read(fp, strsh.sh_offset, riscv->sym_str, strsh.sh_size)) goto fail;
+    riscv->sym_str[strsh.sh_size] = '\0';
+    for (j = 0; j < n; j++) {
+        if (!elf_read(fp, sh.sh_offset + j * sh.sh_entsize, &sym, sizeof(sym))) goto fail;
+        if ((sym.st_info & 0xF) > 2 || !sym.st_shndx || sym.st_name >= strsh.sh_size || !riscv->sym_str[sym.st_name]) continue; // notype, object, func
+        riscv->sym_tab[riscv->sym_num].addr = sym.st_value;
+        riscv->sym_tab[riscv->sym_num].size = sym.st_size;
+        riscv->sym_tab[riscv->sym_num].name = riscv->sym_str + sym.st_name;
+        riscv->sym_num++;
+    }
+    qsort(riscv->sym_tab, riscv->sym_num, sizeof(SYMBOL), sym_cmp);
+    return;
+fail:
+    free(riscv->sym_tab); riscv->sym_tab = NULL; riscv->sym_num = 0;
+    free(riscv->sym_str); riscv->sym_str = NULL;
+}
+
+// elf rom, the pt_load segments go to their physical addresses, bss is left to the fresh zero pages of the ram and
+// the pc starts at e_entry. returns 0 if it's loaded, -1 if it's not an elf file, -2 if it can't be loaded
+static int riscv_load_elf(RISCV *riscv, char *file)
+{
+    FILE      *fp = fopen(file, "rb");
+    ELFEHDR eh;
+    ELFPHDR ph;
+    int        ret = -2, i;
+    if (!fp) return -1;
+    if (!elf_read(fp, 0, &eh, sizeof(eh)) || memcmp(eh.e_ident, "\x7f" "ELF", 4) != 0) { fclose(fp); return -1; }
+    if (eh.e_ident[4] != 1 || eh.e_ident[5] != 1 || eh.e_machine != ELF_EM_RISCV || eh.e_phentsize < sizeof(ph)) goto done; // elf32, little endian
+    for (i = 0; i < eh.e_phnum; i++) {
+        if (!elf_read(fp, eh.e_phoff + i * eh.e_phentsize, &ph, sizeof(ph))) goto done;
+        if (ph.p_type != ELF_PT_LOAD || !ph.p_memsz) continue;
+        if (ph.p_filesz > ph.p_memsz || ph.p_paddr >= REG_FFVM_STDIO || (ph.p_paddr & riscv->mem_mask) + (uint64_t)ph.p_memsz > riscv->mem_mask + 1ull) goto done;
+        if (!elf_read(fp, ph.p_offset, riscv->mem + (ph.p_paddr & riscv->mem_mask), ph.p_filesz)) goto done;
+    }
+    elf_load_symbols(riscv, fp, &eh);
+    riscv->pc = eh.e_entry;
+    ret = 0;
+done:
+    if (ret) printf("failed to load elf rom: %s\n", file);
+    fclose(fp);
+    return ret;
+}
+
+// the symbol addr falls into, for tools like a profiler, NULL if there's none. a symbol without a size reaches up
+// to the next one
+const char* riscv_symbol(RISCV *riscv, uint32_t addr, uint32_t *offset)
+{
+    SYMBOL *tab = riscv->mach->sym_tab;
+    int       lo  = 0, hi = (int)riscv->mach->sym_num - 1, mid;
+    while (lo <= hi) {
+        mid = (lo + hi) / 2;
+        if (tab[mid].addr <= addr) lo = mid + 1;
+        else hi = mid - 1;
+    }
+    if (hi < 0 || (tab[hi].size && addr - tab[hi].addr >= tab[hi].size)) return NULL;
+    if (offset) *offset = addr - tab[hi].addr;
+    return tab[hi].name;
+}
+
+RISCV* riscv_init(char *rom, char *disk, char *ethdev, char *ethpcap, uint32_t memsize)
+{
+    FILE  *fp    = NULL;
+    RISCV *riscv = calloc(1, sizeof(RISCV));
+    if (!riscv) return NULL;
+    if (!(riscv->mem = mem_map(memsize))) { free(riscv); return NULL; }
+    riscv->mem_mask = memsize - 1;
+    riscv_hart_reset(riscv, riscv, 0);
+    riscv->harts[0] = riscv;
+    riscv->nharts   = 1;
+    memset(riscv->reserved_tab, 0xFF, sizeof(riscv->reserved_tab));
+    for (int i = 1; i < FFVM_PLIC_SOURCES; i++) riscv->plic_prio[i] = 1;
+    riscv->plic_enable[0] = ~1u; // hart 0 m-mode gets all the device interrupts, as it did before the plic
+    pthread_mutex_init(&riscv->mmio_lock, NULL);
+    switch (riscv_load_elf(riscv, rom)) {
+    case -2: mem_unmap(riscv->mem, memsize); free(riscv); return NULL;
+    case -1:
+        if (mem_map_file(riscv->mem, memsize, rom) < 0 && (fp = fopen(rom, "rb"))) {
+            fread(riscv->mem, 1, memsize, fp);
+            fclose(fp);
+        }
+        break;
     }
     riscv->disk_fp = fopen(disk, "rb+");
+    for (int i = 0; i < FFVM_ETHPHY_RXQ_SIZE; i++) riscv->ethphy_rxq[i].seq = i;
+    if (ethpcap) ethphy_pcap_open(riscv, ethpcap);
     if (ethdev >= 0) riscv->ethphy_dev = ethphy_open(ethdev, ffvm_ethphy_callback, riscv);
-    riscv->ffvm_start_tick = get_tick_count();
+    riscv->ffvm_start_tick = get_tick_count_us();
+    riscv->ffvm_start_time = time(NULL);
     return riscv;
 }
 
+// secondary harts, each one runs on its own host thread paced like hart 0 in main, all of them start at the reset
+// pc and tell themselves apart by mhartid. they exit once the guest stops hart 0 by writing cpu_freq 0
+static void* riscv_hart_thread(void *arg)
+{
+    RISCV   *riscv = arg, *mach = riscv->mach;
+    uint64_t next_tick = get_tick_count_us();
+    int64_t  sleep_tick;
+    while ((riscv->cpu_freq = __atomic_load_n(&mach->cpu_freq, __ATOMIC_RELAXED))) {
+        riscv->mtime_freq = mach->mtime_freq;
+        if (riscv->fast) {
+            riscv_run_slice(riscv, riscv_fast_slice(riscv), get_tick_count_us() + FFVM_FAST_SLICE_US);
+        } else {
+            next_tick += 1000000 / RISCV_FRAMERATE / 10;
+            riscv_run_slice(riscv, riscv->cpu_freq / RISCV_FRAMERATE / 10, next_tick);
+        }
+        riscv->mtimecur = ffvm_mtime(riscv);
+        riscv_interrupt(riscv);
+        if (riscv->vtime || riscv->fast) continue;
+        sleep_tick = (int64_t)(next_tick - get_tick_count_us());
+        if (sleep_tick > 0) usleep(sleep_tick);
+    }
+    return NULL;
+}
+
+static void riscv_smp_start(RISCV *mach, uint32_t n)
+{
+    RISCV *riscv;
+    for (uint32_t i = 1; i < n && i < FFVM_MAX_HARTS; i++) {
+        if (!(riscv = calloc(1, sizeof(RISCV)))) break;
+        riscv_hart_reset(riscv, mach, i);
+        riscv->pc    = mach->pc; // the elf entry if there is one
+        riscv->vtime = mach->vtime;
+        riscv->fast  = mach->fast;
+        riscv->hsm   = mach->sbi ? FFVM_HSM_STOPPED : FFVM_HSM_STARTED; // the kernel starts them through the sbi
+        mach->harts[mach->nharts++] = riscv;
+    }
+    for (uint32_t i = 1; i < mach->nharts; i++) pthread_create(&mach->harts[i]->thread, NULL, riscv_hart_thread, mach->harts[i]);
+}
+
+typedef struct {
+    uint8_t  dt [0x3000]; // structure block
+    char     str[0x400];  // strings block
+    uint32_t dlen, slen;
+} FDT;
+
+static void fdt_put(FDT *f, const void *data, uint32_t len)
+{
+    if (f->dlen + len + 4 > sizeof(f->dt)) return;
+    memcpy(f->dt + f->dlen, data, len);
+    f->dlen = (f->dlen + len + 3) & ~3; // the padding is left zero from calloc
+}
+
+static void fdt_u32 (FDT *f, uint32_t v) { uint8_t b[4] = { v >> 24, v >> 16, v >> 8, v }; fdt_put(f, b, 4); }
+static void fdt_node(FDT *f, const char *name) { fdt_u32(f, 1); fdt_put(f, name, strlen(name) + 1); }
+static void fdt_end (FDT *f) { fdt_u32(f, 2); }
+
+static void fdt_prop(FDT *f, const char *name, const void *data, uint32_t len)
+{
+    uint32_t off = 0;
+    while (off < f->slen && strcmp(f->str + off, name) != 0) off += strlen(f->str + off) + 1;
+    if (off == f->slen && off + strlen(name) + 1 <= sizeof(f->str)) f->slen += sprintf(f->str + off, "%s", name) + 1;
+    fdt_u32(f, 3); fdt_u32(f, len); fdt_u32(f, off); fdt_put(f, data, len);
+}
+
+static void fdt_cells(FDT *f, const char *name, const uint32_t *cells, int n)
+{
+    uint32_t be[4 * FFVM_MAX_HARTS], i;
+    for (i = 0; i < (uint32_t)n; i++) be[i] = ((cells[i] >> 24) & 0xFF) | ((cells[i] >> 8) & 0xFF00) | ((cells[i] << 8) & 0xFF0000) | (cells[i] << 24);
+    fdt_prop(f, name, be, n * 4);
+}
+
+static void fdt_u32p(FDT *f, const char *name, uint32_t v) { fdt_cells(f, name, &v, 1); }
+static void fdt_str (FDT *f, const char *name, const char *s) { fdt_prop(f, name, s, strlen(s) + 1); }
+
+// the device tree for the kernel, the ram, the harts with their interrupt controllers, the clint and the plic
+// with the contexts in hart order, m-mode first. the sbi console is the kernel console. it's put at the top of the
+// ram, returns its address
+static uint32_t ffvm_sbi_fdt(RISCV *mach)
+{
+    static const char s_clint[] = "sifive,clint0\0riscv,clint0", s_plic[] = "sifive,plic-1.0.0\0riscv,plic0";
+    FDT     *f = calloc(1, sizeof(FDT));
+    uint32_t n = mach->nharts, addr = 0x80000000 + mach->mem_mask + 1 - FFVM_SBI_FDT_SIZE, hdr[10], c[4 * FFVM_MAX_HARTS], i;
+    uint8_t *dst = mach->mem + (addr & mach->mem_mask);
+    char     name[32];
+    if (!f) return 0;
+    fdt_node(f, "");
+    fdt_u32p(f, "#address-cells", 1);
+    fdt_u32p(f, "#size-cells", 1);
+    fdt_str (f, "compatible", "ffvm");
+    fdt_str (f, "model", "ffvm");
+    fdt_node(f, "chosen");
+    fdt_str (f, "bootargs", "console=hvc0 earlycon=sbi");
+    fdt_end (f);
+    fdt_node(f, "memory@80000000");
+    fdt_str (f, "device_type", "memory");
+    c[0] = 0x80000000, c[1] = mach->mem_mask + 1; fdt_cells(f, "reg", c, 2);
+    fdt_end (f);
+    fdt_node(f, "cpus");
+    fdt_u32p(f, "#address-cells", 1);
+    fdt_u32p(f, "#size-cells", 0);
+    fdt_u32p(f, "timebase-frequency", mach->mtime_freq);
+    for (i = 0; i < n; i++) {
+        sprintf(name, "cpu@%u", i);
+        fdt_node(f, name);
+        fdt_str (f, "device_type", "cpu");
+        fdt_u32p(f, "reg", i);
+        fdt_str (f, "compatible", "riscv");
+        fdt_str (f, "riscv,isa", "rv32imafdc");
+        fdt_str (f, "mmu-type", "riscv,sv32");
+        fdt_str (f, "status", "okay");
+        fdt_node(f, "interrupt-controller");
+        fdt_u32p(f, "#interrupt-cells", 1);
+        fdt_prop(f, "interrupt-controller", NULL, 0);
+        fdt_str (f, "compatible", "riscv,cpu-intc");
+        fdt_u32p(f, "phandle", i + 1);
+        fdt_end (f);
+        fdt_end (f);
+    }
+    fdt_end (f);
+    fdt_node(f, "soc");
+    fdt_u32p(f, "#address-cells", 1);
+    fdt_u32p(f, "#size-cells", 1);
+    fdt_str (f, "compatible", "simple-bus");
+    fdt_prop(f, "ranges", NULL, 0);
+    sprintf(name, "clint@%x", REG_FFVM_CLINT_MSIP);
+    fdt_node(f, name);
+    fdt_prop(f, "compatible", s_clint, sizeof(s_clint));
+    c[0] = REG_FFVM_CLINT_MSIP, c[1] = REG_FFVM_CLINT_END - REG_FFVM_CLINT_MSIP; fdt_cells(f, "reg", c, 2);
+    for (i = 0; i < n; i++) c[4 * i + 0] = c[4 * i + 2] = i + 1, c[4 * i + 1] = INTR_MACHINE_SOFTWARE, c[4 * i + 3] = INTR_MACHINE_TIMER;
+    fdt_cells(f, "interrupts-extended", c, 4 * n);
+    fdt_end (f);
+    sprintf(name, "plic@%x", REG_FFVM_PLIC_PRIORITY);
+    fdt_node(f, name);
+    fdt_prop(f, "compatible", s_plic, sizeof(s_plic));
+    c[0] = REG_FFVM_PLIC_PRIORITY, c[1] = REG_FFVM_PLIC_END - REG_FFVM_PLIC_PRIORITY; fdt_cells(f, "reg", c, 2);
+    fdt_u32p(f, "#address-cells", 0);
+    fdt_u32p(f, "#interrupt-cells", 1);
+    fdt_prop(f, "interrupt-controller", NULL, 0);
+    fdt_u32p(f, "riscv,ndev", FFVM_PLIC_SOURCES - 1);
+    fdt_u32p(f, "phandle", n + 1);
+    for (i = 0; i < n; i++) c[4 * i + 0] = c[4 * i + 2] = i + 1, c[4 * i + 1] = INTR_MACHINE_EXTERNAL, c[4 * i + 3] = INTR_SUPERVISOR_EXTERNAL;
+    fdt_cells(f, "interrupts-extended", c, 4 * n);
+    fdt_end (f);
+    fdt_end (f);
+    fdt_end (f);
+    fdt_u32 (f, 9);
+    c[0] = 0xD00DFEED; c[1] = 40 + 16 + f->dlen + f->slen; c[2] = 40 + 16; c[3] = 40 + 16 + f->dlen; c[4] = 40;
+    c[5] = 17; c[6] = 16; c[7] = 0; c[8] = f->slen; c[9] = f->dlen;
+    for (i = 0; i < 10; i++) hdr[i] = ((c[i] >> 24) & 0xFF) | ((c[i] >> 8) & 0xFF00) | ((c[i] << 8) & 0xFF0000) | (c[i] << 24);
+    memcpy(dst, hdr, 40);
+    memset(dst + 40, 0, 16); // empty memory reservation map
+    memcpy(dst + 56, f->dt, f->dlen);
+    memcpy(dst + 56 + f->dlen, f->str, f->slen);
+    free(f);
+    return addr;
+}
+
+// with the built-in sbi the boot hart starts in s-mode at the rom entry with the device tree, the other harts stay
+// stopped till the kernel starts them. mtime counts in us
+static void ffvm_sbi_init(RISCV *mach)
+{
+    mach->mtime_freq = FFVM_MTIME_FREQ_MAX;
+    ffvm_sbi_hart_boot(mach, mach->pc, ffvm_sbi_fdt(mach));
+}
+
 void riscv_free(RISCV *riscv)
 {
     if (!riscv) return;
+    for (uint32_t i = 1; i < riscv->nharts; i++) {
+        pthread_join(riscv->harts[i]->thread, NULL);
+        pthread_mutex_destroy(&riscv->harts[i]->wfi_lock);
+        pthread_cond_destroy (&riscv->harts[i]->wfi_cond);
+        free(riscv->harts[i]);
+    }
     ethphy_close(riscv->ethphy_dev);
+    if (riscv->ethphy_pcap) fclose(riscv->ethphy_pcap);
     vdev_exit(riscv->vdev, 1);
     adev_exit(riscv->adev);
     if (riscv->disk_fp) fclose(riscv->disk_fp);
     free(riscv->adev_out_buf);
+    pthread_mutex_destroy(&riscv->wfi_lock);
+    pthread_cond_destroy (&riscv->wfi_cond);
+    pthread_mutex_destroy(&riscv->mmio_lock);
+    mem_unmap(riscv->mem, riscv->mem_mask + 1);
+    free(riscv->sym_tab);
+    free(riscv->sym_str);
     free(riscv);
 }
 
@@ -859,36 +3093,84 @@ int main(int argc, char *argv[])
     char *rom    = "test.rom";
     char *disk   = "disk.img";
     char *ethdev = "tap-win32";
-    uint32_t next_tick = 0, run_counter = 0;
-    int32_t  sleep_tick, i, j;
+    char *ethpcap= NULL;
+    int   vtime  = 0;
+    int   fast   = 0;
+    int   smp    = 1;
+    int   sbi    = 0;
+    int   mem    = FFVM_MEM_SIZE_DEF >> 20; // MB
+    uint64_t next_tick = 0;
+    uint32_t run_counter = 0;
+    int64_t  sleep_tick;
+    int32_t  i, j;
     RISCV   *riscv = NULL;
 
     for (i = 1; i < argc; i++) {
         if      (strstr(argv[i], "--disk="  ) == argv[i]) disk   = argv[i] + sizeof("--disk="  ) - 1;
         else if (strstr(argv[i], "--ethdev=") == argv[i]) ethdev = argv[i] + sizeof("--ethdev=") - 1;
+        else if (strstr(argv[i], "--ethpcap=")== argv[i]) ethpcap= argv[i] + sizeof("--ethpcap=")- 1;
+        else if (strcmp (argv[i], "--vtime"  ) == 0      ) vtime  = 1;
+        else if (strcmp (argv[i], "--fast"   ) == 0      ) fast   = 1;
+        else if (strcmp (argv[i], "--sbi"    ) == 0      ) sbi    = 1;
+        else if (strstr (argv[i], "--smp="   ) == argv[i]) smp    = atoi(argv[i] + sizeof("--smp=") - 1);
+        else if (strstr (argv[i], "--mem="   ) == argv[i]) mem    = atoi(argv[i] + sizeof("--mem=") - 1);
         else rom = argv[i];
     }
 
     printf("rom   : %s\n", rom   );
     printf("disk  : %s\n", disk  );
     printf("ethdev: %s\n", ethdev);
+    if (ethpcap) printf("ethpcap: %s\n", ethpcap);
+    if (vtime  ) printf("vtime : on\n");
+    if (fast   ) printf("fast  : on\n");
+    if (sbi    ) printf("sbi   : on\n");
+    if (smp > 1) printf("smp   : %d\n", smp < FFVM_MAX_HARTS ? smp : FFVM_MAX_HARTS);
+    mem = mem < (FFVM_MEM_SIZE_MIN >> 20) ? (FFVM_MEM_SIZE_MIN >> 20) : mem > (FFVM_MEM_SIZE_MAX >> 20) ? (FFVM_MEM_SIZE_MAX >> 20) : mem;
+    while (mem & (mem - 1)) mem &= mem - 1; // round down to a power of 2
+    if (mem != (FFVM_MEM_SIZE_DEF >> 20)) printf("mem   : %dMB\n", mem);
 
-    if (!(riscv = riscv_init(rom, disk, ethdev))) return 0;
+    if (!(riscv = riscv_init(rom, disk, ethdev, ethpcap, (uint32_t)mem << 20))) return 0;
+    riscv->vtime = vtime;
+    riscv->fast  = fast;
+    riscv->sbi   = sbi;
     console_init();
+    riscv_smp_start(riscv, smp);
+    if (riscv->sbi) ffvm_sbi_init(riscv);
 
-    next_tick = (uint32_t)get_tick_count();
+    next_tick = get_tick_count_us();
     while (riscv->cpu_freq) {
+        if (riscv->fast) { // unthrottled, the frame work is done at the frame rate in host time
+            riscv_run_slice(riscv, riscv_fast_slice(riscv), get_tick_count_us() + FFVM_FAST_SLICE_US);
+            riscv->mtimecur = ffvm_mtime(riscv);
+            ffvm_lock(riscv);
+            ethphy_rx_drain(riscv);
+            ffvm_unlock(riscv);
+            riscv_interrupt(riscv);
+            if ((int64_t)(get_tick_count_us() - next_tick) < 0) continue;
+            next_tick = get_tick_count_us() + 1000000 / RISCV_FRAMERATE;
+            ffvm_lock(riscv);
+            disp_refresh(riscv, run_counter  );
+            audio_update(riscv, run_counter++);
+            ffvm_unlock(riscv);
+            continue;
+        }
         for (j = 0; j < 10; j++) {
-            for (i = 0; i < riscv->cpu_freq / RISCV_FRAMERATE / 10; i++) riscv_run(riscv);
-            riscv->mtimecur = get_tick_count() - riscv->ffvm_start_tick;
+            riscv_run_slice(riscv, riscv->cpu_freq / RISCV_FRAMERATE / 10, next_tick + (j + 1) * 1000000 / RISCV_FRAMERATE / 10);
+            riscv->mtimecur = ffvm_mtime(riscv);
+            ffvm_lock(riscv);
+            ethphy_rx_drain(riscv);
+            ffvm_unlock(riscv);
             riscv_interrupt(riscv);
         }
+        ffvm_lock(riscv);
         disp_refresh(riscv, run_counter  );
         audio_update(riscv, run_counter++);
+        ffvm_unlock(riscv);
 
-        next_tick += 1000 / RISCV_FRAMERATE;
-        sleep_tick = (int32_t)next_tick - (int32_t)get_tick_count();
-        if (sleep_tick > 0) usleep(sleep_tick * 1000);
+        next_tick += 1000000 / RISCV_FRAMERATE;
+        if (riscv->vtime) continue;
+        sleep_tick = (int64_t)(next_tick - get_tick_count_us());
+        if (sleep_tick > 0) usleep(sleep_tick);
 //      printf("sleep_tick: %d\n", sleep_tick);
     }
 
@@ -0,0 +1,166 @@
+#include <stdint.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "netcsum.h"
+
+#define net_htons(v) __builtin_bswap16(v)
+
+static uint64_t csum_add64(uint64_t sum, const uint8_t *p, int len)
+{
+#ifdef __SSE2__
+    // widen 32bit words into two 64bit lanes, carries are folded once at the end
+    __m128i acc1 = _mm_setzero_si128(), acc2 = _mm_setzero_si128(), zero = _mm_setzero_si128(), v;
+    uint64_t lanes[2];
+    for (; len >= 32; p += 32, len -= 32) {
+        v    = _mm_loadu_si128((const __m128i*)(p + 0 ));
+        acc1 = _mm_add_epi64(acc1, _mm_unpacklo_epi32(v, zero));
+        acc2 = _mm_add_epi64(acc2, _mm_unpackhi_epi32(v, zero));
+        v    = _mm_loadu_si128((const __m128i*)(p + 16));
+        acc1 = _mm_add_epi64(acc1, _mm_unpacklo_epi32(v, zero));
+        acc2 = _mm_add_epi64(acc2, _mm_unpackhi_epi32(v, zero));
+    }
+    _mm_storeu_si128((__m128i*)lanes, _mm_add_epi64(acc1, acc2));
+    sum += lanes[0] + lanes[1];
+#endif
+    uint32_t w32; uint16_t w16;
+    for (; len >= 4; p += 4, len -= 4) { memcpy(&w32, p, 4); sum += w32; }
+    if (len >= 2) { memcpy(&w16, p, 2); sum += w16; p += 2; len -= 2; }
+    if (len) sum += *p;
+    return sum;
+}
+
+uint32_t net_csum_add(uint32_t sum, const void *buf, int len)
+{
+    uint64_t s = csum_add64(sum, buf, len);
+    s = (s & 0xFFFFFFFF) + (s >> 32);
+    s = (s & 0xFFFFFFFF) + (s >> 32);
+    return (uint32_t)s;
+}
+
+uint16_t net_csum_fold(uint32_t sum)
+{
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    sum = (sum & 0xFFFF) + (sum >> 16);
+    return (uint16_t)~sum;
+}
+
+typedef struct {
+    uint8_t *ip;
+    uint8_t *l4;
+    int      iphl;  // ipv4 header length, 0 for ipv6
+    int      l4len;
+    int      proto;
+    uint32_t pseudo; // pseudo header sum
+} FRAMEINFO;
+
+static int frame_parse(uint8_t *frame, int len, FRAMEINFO *info)
+{
+    uint8_t *end  = frame + len;
+    uint8_t *ip   = frame + 14;
+    int      type;
+    if (len < 14) return -1;
+    type = frame[12] << 8 | frame[13];
+    if (type == 0x8100 && len >= 18) { type = frame[16] << 8 | frame[17]; ip += 4; } // vlan tag
+    memset(info, 0, sizeof(FRAMEINFO));
+    info->ip = ip;
+    if (type == 0x0800) {
+        if (ip + 20 > end || (ip[0] >> 4) != 4) return -1;
+        info->iphl = (ip[0] & 0xF) * 4;
+        int totlen = ip[2] << 8 | ip[3];
+        if (info->iphl < 20 || totlen < info->iphl || ip + totlen > end) return -1;
+        if ((ip[6] & 0x3F) || ip[7]) return 0; // fragment, only the ip header checksum applies
+        info->proto  = ip[9];
+        info->l4     = ip + info->iphl;
+        info->l4len  = totlen - info->iphl;
+        info->pseudo = info->proto == 1 ? 0 : net_csum_add(net_htons(info->proto) + net_htons(info->l4len), ip + 12, 8);
+        return 0;
+    } else if (type == 0x86DD) {
+        if (ip + 40 > end || (ip[0] >> 4) != 6) return -1;
+        info->proto  = ip[6];
+        info->l4     = ip + 40;
+        info->l4len  = ip[4] << 8 | ip[5];
+        if (info->l4 + info->l4len > end) return -1;
+        info->pseudo = net_csum_add(net_htons(info->proto) + net_htons(info->l4len), ip + 8, 32);
+        return 0;
+    }
+    return -1;
+}
+
+static int l4_csum_offset(FRAMEINFO *info)
+{
+    switch (info->proto) {
+    case 6 : return info->l4len >= 20 ? 16 : -1; // tcp
+    case 17: return info->l4len >= 8  ? 6  : -1; // udp
+    case 1 : return info->l4len >= 4 && info->iphl ? 2 : -1; // icmp
+    case 58: return info->l4len >= 4 && !info->iphl ? 2 : -1; // icmpv6
+    }
+    return -1;
+}
+
+int net_csum_frame(uint8_t *frame, int len, int insert)
+{
+    FRAMEINFO info;
+    uint16_t  csum;
+    int       off, ret = NET_CSUM_OK;
+    if (frame_parse(frame, len, &info) != 0) return NET_CSUM_NONE;
+    if (info.iphl) {
+        if (insert) { info.ip[10] = info.ip[11] = 0; csum = net_csum_fold(net_csum_add(0, info.ip, info.iphl)); memcpy(info.ip + 10, &csum, 2); }
+        else if (net_csum_fold(net_csum_add(0, info.ip, info.iphl)) != 0) return NET_CSUM_BAD;
+    }
+    if (!info.l4 || (off = l4_csum_offset(&info)) < 0) return ret;
+    if (insert) {
+        info.l4[off] = info.l4[off + 1] = 0;
+        csum = net_csum_fold(net_csum_add(info.pseudo, info.l4, info.l4len));
+        if (csum == 0 && info.proto == 17) csum = 0xFFFF;
+        memcpy(info.l4 + off, &csum, 2);
+    } else {
+        if (info.proto == 17 && info.iphl && !info.l4[off] && !info.l4[off + 1]) return ret; // udp over ipv4 without checksum
+        if (net_csum_fold(net_csum_add(info.pseudo, info.l4, info.l4len)) != 0) ret = NET_CSUM_BAD;
+    }
+    return ret;
+}
+
+int net_tso_count(uint8_t *frame, int len, int mss)
+{
+    FRAMEINFO info;
+    int       hdrlen, payload;
+    if (mss <= 0 || frame_parse(frame, len, &info) != 0 || info.proto != 6 || info.l4len < 20) return 0;
+    hdrlen  = (info.l4[12] >> 4) * 4;
+    payload = info.l4len - hdrlen;
+    if (hdrlen < 20 || payload < 0) return 0;
+    return payload ? (payload + mss - 1) / mss : 1;
+}
+
+int net_tso_build(uint8_t *frame, int len, int mss, int idx, uint8_t *seg)
+{
+    FRAMEINFO info;
+    int       hdrlen, payload, off, n, last;
+    uint32_t  seq;
+    frame_parse(frame, len, &info);
+    hdrlen  = info.l4 - frame + (info.l4[12] >> 4) * 4;
+    payload = info.l4len - (info.l4[12] >> 4) * 4;
+    off     = idx * mss;
+    n       = payload - off < mss ? payload - off : mss;
+    last    = off + n >= payload;
+    memcpy(seg, frame, hdrlen);
+    memcpy(seg + hdrlen, frame + hdrlen + off, n);
+
+    uint8_t *ip  = seg + (info.ip - frame);
+    uint8_t *tcp = seg + (info.l4 - frame);
+    if (info.iphl) {
+        int totlen = hdrlen - (info.ip - frame) + n, id = (ip[4] << 8 | ip[5]) + idx;
+        ip[2] = totlen >> 8, ip[3] = totlen;
+        ip[4] = id     >> 8, ip[5] = id;
+    } else {
+        int plen = hdrlen - (info.l4 - frame) + n;
+        ip[4] = plen >> 8, ip[5] = plen;
+    }
+    seq = (tcp[4] << 24 | tcp[5] << 16 | tcp[6] << 8 | tcp[7]) + off;
+    tcp[4] = seq >> 24, tcp[5] = seq >> 16, tcp[6] = seq >> 8, tcp[7] = seq;
+    if (!last) tcp[13] &= ~0x09; // fin & psh only on the last segment
+    if (idx  ) tcp[13] &= ~0x80; // cwr only on the first segment
+    net_csum_frame(seg, hdrlen + n, 1);
+    return hdrlen + n;
+}
@@ -0,0 +1,23 @@
+#ifndef __NETCSUM_H__
+#define __NETCSUM_H__
+
+#include <stdint.h>
+
+#define NET_CSUM_NONE  0 // not an ipv4/ipv6 frame, nothing checked
+#define NET_CSUM_OK    1
+#define NET_CSUM_BAD   2
+
+// one's complement sum helpers, sums are kept in memory byte order (little endian host),
+// so a folded checksum can be stored with a plain 16bit write
+uint32_t net_csum_add (uint32_t sum, const void *buf, int len);
+uint16_t net_csum_fold(uint32_t sum);
+
+// insert = 1: fill ipv4 header and tcp/udp/icmp checksums, insert = 0: verify them
+int net_csum_frame(uint8_t *frame, int len, int insert);
+
+// tcp segmentation offload, net_tso_count returns the number of segments, or 0 if the
+// frame is not a tcp frame, net_tso_build writes segment idx into seg and returns its size
+int net_tso_count(uint8_t *frame, int len, int mss);
+int net_tso_build(uint8_t *frame, int len, int mss, int idx, uint8_t *seg);
+
+#endif
@@ -3,8 +3,16 @@
 #include <unistd.h>
 #include <time.h>
 #include <pthread.h>
+#ifdef WIN32
 #include <windows.h>
 #include <conio.h>
+#else
+#include <poll.h>
+#include <termios.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#endif
 #include "utils.h"
 
 uint64_t get_tick_count(void)
@@ -18,8 +26,64 @@ uint64_t get_tick_count(void)
 #endif
 }
 
-static pthread_mutex_t s_lock = (pthread_mutex_t)NULL;
-static pthread_t    s_hthread = (pthread_t      )NULL;
+uint64_t get_tick_count_us(void)
+{
+#ifdef WIN32
+    LARGE_INTEGER freq, cnt;
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&cnt);
+    return (uint64_t)(cnt.QuadPart / freq.QuadPart) * 1000000 + (uint64_t)(cnt.QuadPart % freq.QuadPart) * 1000000 / freq.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+#endif
+}
+
+void* mem_map(uint32_t size)
+{
+#ifdef WIN32
+    return VirtualAlloc(NULL, size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#else
+    void *addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    return addr == MAP_FAILED ? NULL : addr;
+#endif
+}
+
+void mem_unmap(void *addr, uint32_t size)
+{
+    if (!addr) return;
+#ifdef WIN32
+    VirtualFree(addr, 0, MEM_RELEASE);
+#else
+    munmap(addr, size);
+#endif
+}
+
+// the file pages stay shared with the page cache, and so with every other mapping of it, until they are written.
+// returns the number of bytes of the file mapped, -1 if it can't be mapped and has to be read in
+int mem_map_file(void *addr, uint32_t size, char *file)
+{
+#ifdef WIN32
+    return -1; // a view can't replace part of a VirtualAlloc region
+#else
+    struct stat st;
+    size_t page = sysconf(_SC_PAGESIZE), len;
+    int    fd   = open(file, O_RDONLY);
+    if (fd < 0) return -1;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) { close(fd); return -1; }
+    len = (uint64_t)st.st_size < size ? (size_t)st.st_size : size;
+    if (len && mmap(addr, (len + page - 1) / page * page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        mmap(addr, (len + page - 1) / page * page, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+        len = -1;
+    }
+    close(fd);
+    return (int)len;
+#endif
+}
+
+static pthread_mutex_t s_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_t    s_hthread = (pthread_t      )0;
 #define MAXBUFZIE   256
 #define FLAG_EXIT  (1 << 0)
 #define FLAG_PAUSE (1 << 1)
@@ -31,6 +95,10 @@ static void* console_thread_proc(void *arg)
 {
     while (!(s_flags & FLAG_EXIT)) {
         if (s_flags & FLAG_PAUSE) { usleep(100 * 1000); continue; }
+#ifndef WIN32
+        struct pollfd pfd = { .fd = STDIN_FILENO, .events = POLLIN };
+        if (poll(&pfd, 1, 100) <= 0) continue; // timeout, so that pause/exit flags get checked
+#endif
         int c = fgetc(stdin);
         pthread_mutex_lock(&s_lock);
         if (!(s_flags & FLAG_PAUSE)) {
@@ -45,6 +113,7 @@ static void* console_thread_proc(void *arg)
 
 static void console_thread_signal(void)
 {
+#ifdef WIN32
     DWORD        n   = 0;
     INPUT_RECORD rec = {};
     rec.EventType                      = KEY_EVENT;
@@ -55,6 +124,7 @@ static void console_thread_signal(void)
     WriteConsoleInput(GetStdHandle(STD_INPUT_HANDLE), &rec, 1, &n);
     rec.Event.KeyEvent.uChar.AsciiChar = '\n';
     WriteConsoleInput(GetStdHandle(STD_INPUT_HANDLE), &rec, 1, &n);
+#endif
 }
 
 static void console_thread_pause(void)
@@ -69,7 +139,6 @@ static void console_thread_pause(void)
 
 void console_init(void)
 {
-    if (!s_lock) pthread_mutex_init(&s_lock, NULL);
     if (!s_hthread) { s_flags = 0; pthread_create(&s_hthread, NULL, console_thread_proc, NULL); }
 }
 
@@ -79,8 +148,7 @@ void console_exit(void)
     s_flags |= FLAG_EXIT;
     console_thread_signal();
     pthread_mutex_unlock(&s_lock);
-    if (s_hthread) { pthread_join(s_hthread, NULL);  s_hthread = (pthread_t      )NULL; }
-    if (s_lock   ) { pthread_mutex_destroy(&s_lock); s_lock    = (pthread_mutex_t)NULL; }
+    if (s_hthread) { pthread_join(s_hthread, NULL); s_hthread = (pthread_t)0; }
 }
 
 int console_getc(void)
@@ -93,6 +161,7 @@ int console_getc(void)
     return c;
 }
 
+#ifdef WIN32
 int  console_getch (void) { console_thread_pause(); return getch(); }
 int  console_kbhit (void) { console_thread_pause(); return kbhit(); }
 void console_clrscr(void) { system("cls");  }
@@ -102,3 +171,43 @@ void console_gotoxy(int x, int y)
     COORD coord = { .X = x, .Y = y };
     SetConsoleCursorPosition(GetStdHandle(STD_OUTPUT_HANDLE), coord);
 }
+#else
+static int console_rawmode(int raw)
+{
+    static struct termios s_saved;
+    static int            s_raw;
+    if (raw && !s_raw) {
+        struct termios t;
+        if (tcgetattr(STDIN_FILENO, &s_saved) != 0) return -1;
+        t = s_saved; t.c_lflag &= ~(ICANON | ECHO); t.c_cc[VMIN] = 1; t.c_cc[VTIME] = 0;
+        tcsetattr(STDIN_FILENO, TCSANOW, &t);
+    } else if (!raw && s_raw) {
+        tcsetattr(STDIN_FILENO, TCSANOW, &s_saved);
+    }
+    s_raw = raw;
+    return 0;
+}
+
+int console_getch(void)
+{
+    int c;
+    console_thread_pause();
+    console_rawmode(1);
+    c = getchar();
+    console_rawmode(0);
+    return c;
+}
+
+int console_kbhit(void)
+{
+    struct pollfd pfd = { .fd = STDIN_FILENO, .events = POLLIN };
+    console_thread_pause();
+    console_rawmode(1);
+    int ret = poll(&pfd, 1, 0) > 0;
+    console_rawmode(0);
+    return ret;
+}
+
+void console_clrscr(void) { fputs("\033[2J\033[H", stdout); fflush(stdout); }
+void console_gotoxy(int x, int y) { printf("\033[%d;%dH", y + 1, x + 1); fflush(stdout); }
+#endif
@@ -3,7 +3,12 @@
 
 #include <stdint.h>
 
-uint64_t get_tick_count(void);
+uint64_t get_tick_count   (void); // ms
+uint64_t get_tick_count_us(void); // us
+
+void* mem_map  (uint32_t size); // anonymous zero filled memory, pages are backed on first touch, NULL on failure
+void  mem_unmap(void *addr, uint32_t size);
+int   mem_map_file(void *addr, uint32_t size, char *file); // copy on write over the start of a mem_map region
 
 void console_init  (void);
 void console_exit  (void);